@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "batch.h"
+#include <opencv2/videoio.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace marker {
+
+namespace {
+
+/* Decodes up to count frames into frames, returns the number decoded. The Mats are
+ * reused, the decoder writes into their buffers once they have the size of the video. */
+int readFrames(cv::VideoCapture& capture, std::vector<cv::Mat>& frames, int count) {
+    if ((int)frames.size() < count) {
+        frames.resize(count);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!capture.read(frames[i])) {
+            return i;
+        }
+    }
+    return count;
+}
+
+} /* End of anonymous namespace */
+
+BatchScanner::BatchScanner(int threads)
+    : openingSize(1), pyramidLevels(0), batchFrames(4), workers(threads) {
+    for (int i = 0; i < workers.size(); i++) {
+        scanners.push_back(std::unique_ptr<Scanner>(new Scanner()));
+    }
+}
+
+void BatchScanner::setLabelKernels(const LabelKernels* kernels) {
+    for (size_t i = 0; i < scanners.size(); i++) {
+        scanners[i]->setLabelKernels(kernels);
+    }
+}
+
+void BatchScanner::configure() {
+    for (size_t i = 0; i < scanners.size(); i++) {
+        Scanner& scanner = *scanners[i];
+        scanner.openingSize = openingSize;
+        scanner.pyramidLevels = pyramidLevels;
+        // The frames are the parallel loop, not the bands of a frame.
+        scanner.threads = 1;
+        scanner.tracking = false;
+    }
+}
+
+void BatchScanner::scan(const cv::Mat* frames, int count, int windowSize, int C,
+                        std::vector<std::vector<Marker> >& results) {
+    configure();
+    results.resize(count);
+    workers.parallelFor(count, [&](int i, int thread) {
+        // findMarkers() does not write to the frame, only the header is copied.
+        cv::Mat frame = frames[i];
+        const std::vector<Marker>& found = scanners[thread]->findMarkers(frame, windowSize, C);
+        // Filled in place: the buffer of the slot is reused once it is large enough.
+        results[i].assign(found.begin(), found.end());
+    });
+}
+
+long BatchScanner::scanVideo(const std::string& path, int windowSize, int C,
+                             std::vector<std::vector<Marker> >& results) {
+    cv::VideoCapture capture(path);
+    if (!capture.isOpened()) {
+        return -1;
+    }
+    const int batch = (batchFrames > 1 ? batchFrames : 1) * workers.size();
+    // An estimate from the container, enough to avoid growing results frame after frame.
+    double frameCount = capture.get(cv::CAP_PROP_FRAME_COUNT);
+    if (frameCount > 0 && frameCount < 1e7) {
+        results.reserve((size_t)frameCount);
+    }
+    configure();
+
+    // The decoder only runs in one thread, for the whole video: it fills one buffer while
+    // the pool scans the other. filled[b] is the number of frames decoded into decoded[b],
+    // -1 while the buffer is being scanned or waits for the decoder.
+    std::mutex lock;
+    std::condition_variable changed;
+    int filled[2] = { -1, -1 };
+    std::thread reader([&] {
+        for (int b = 0;; b ^= 1) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&] { return filled[b] < 0; });
+            }
+            int count = readFrames(capture, decoded[b], batch);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                filled[b] = count;
+            }
+            changed.notify_all();
+            if (count < batch) {
+                return; // End of the video
+            }
+        }
+    });
+
+    long total = 0;
+    for (int b = 0;; b ^= 1) {
+        int count;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&] { return filled[b] >= 0; });
+            count = filled[b];
+        }
+        if ((long)results.size() < total + count) {
+            results.resize(total + count);
+        }
+        workers.parallelFor(count, [&](int i, int thread) {
+            cv::Mat frame = decoded[b][i];
+            const std::vector<Marker>& found = scanners[thread]->findMarkers(frame, windowSize, C);
+            results[total + i].assign(found.begin(), found.end());
+        });
+        total += count;
+        if (count < batch) {
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            filled[b] = -1;
+        }
+        changed.notify_all();
+    }
+    reader.join();
+    results.resize(total);
+    return total;
+}
+
+void BatchScanner::totalStats(ScannerStats& total) const {
+    total.reset();
+    for (size_t s = 0; s < scanners.size(); s++) {
+        const ScannerStats& stats = scanners[s]->stats;
+        total.frames += stats.frames;
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            total.totalUs[i] += stats.totalUs[i];
+        }
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            total.total[i] += stats.total[i];
+        }
+    }
+}
+
+} /* End of namespace marker */
@@ -0,0 +1,82 @@
+/*
+ * Throughput oriented scanning of many frames, one Scanner per thread.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_BATCH_H_
+#define SRC_BATCH_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "marker.h"
+#include "workers.h"
+
+namespace marker {
+
+/* Scans frames independently of each other on a pool of threads, for recorded footage
+ * where the throughput matters more than the latency of a frame.
+ *
+ * A Scanner keeps its scratch buffers from one frame to the next and cannot be shared
+ * between threads: each thread of the pool has its own, configured the same way. The
+ * frames go to the threads by work stealing, the results come back in the order of the
+ * frames. As a frame can be scanned by any of the scanners, the tracking mode, which
+ * needs the previous frame, is not available.
+ */
+class BatchScanner {
+public:
+	/* Threads scanning the frames, the caller of scan() included. */
+	explicit BatchScanner(int threads);
+
+	/* The settings of the scanners, see Scanner. */
+	int openingSize;
+	int pyramidLevels;
+	void setLabelKernels(const LabelKernels* kernels);
+
+	int threads() const { return workers.size(); }
+
+	/* Scans frames[0 .. count) as Scanner::findMarkers() would, results[i] receives the
+	 * markers of frames[i]. The vectors of results are reused, so are their buffers. */
+	void scan(const cv::Mat* frames, int count, int windowSize, int C, std::vector<std::vector<Marker> >& results);
+	void scan(const std::vector<cv::Mat>& frames, int windowSize, int C, std::vector<std::vector<Marker> >& results) {
+		scan(frames.empty() ? NULL : &frames[0], (int)frames.size(), windowSize, C, results);
+	}
+
+	/* Scans all the frames of a video. A single reader thread decodes the frames, one
+	 * batch of batchFrames per thread of the pool ahead of the batch being scanned.
+	 * Returns the number of frames, -1 when the video cannot be opened. */
+	long scanVideo(const std::string& path, int windowSize, int C, std::vector<std::vector<Marker> >& results);
+
+	/* Frames decoded ahead by scanVideo(), per thread of the pool (default 4). */
+	int batchFrames;
+
+	/* The stats of the scanners added together, see Scanner::stats. */
+	void totalStats(ScannerStats& total) const;
+
+private:
+	BatchScanner(const BatchScanner&);
+	BatchScanner& operator=(const BatchScanner&);
+
+	void configure();
+
+	WorkerPool workers;
+	std::vector<std::unique_ptr<Scanner> > scanners; // One per thread of the pool
+	std::vector<cv::Mat> decoded[2];                 // scanVideo(): scanned and decoded in turn
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_BATCH_H_ */
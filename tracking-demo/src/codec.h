@@ -0,0 +1,293 @@
+/*
+ * Reed-Solomon codec specialized at compile time for one code length.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_CODEC_H_
+#define SRC_CODEC_H_
+
+#include <stdint.h>
+#include <string.h>
+
+namespace marker {
+
+enum CodeStatus {
+	CODE_VALID = 0, // All the syndromes are zero, the message is read as is
+	CODE_CORRECTED, // Errors were found and corrected
+	CODE_INVALID    // Too many errors
+};
+
+/* The constant tables of ReedSolomonCodec, built by the compiler. */
+template <int MessageLength, int EccLength>
+struct ReedSolomonTables {
+	static const int LENGTH = MessageLength + EccLength;
+
+	uint8_t exp[512];
+	uint8_t log[256];
+	/* Logs of the coefficients of the generator, highest degree first. */
+	uint8_t generatorLog[EccLength + 1];
+	/* Log of the power of 2 multiplying byte k of the codeword in syndrome i. */
+	uint8_t syndromeLog[EccLength][LENGTH];
+
+	static constexpr ReedSolomonTables make() {
+		ReedSolomonTables t = {};
+		int x = 1;
+		for (int i = 0; i < 255; i++) {
+			t.exp[i] = (uint8_t)x;
+			t.exp[i + 255] = (uint8_t)x;
+			t.log[x] = (uint8_t)i;
+			x <<= 1;
+			if (x & 0x100) {
+				x ^= 0x11d;
+			}
+		}
+		t.exp[510] = t.exp[0];
+		t.exp[511] = t.exp[1];
+		// Generator prod(x - 2^i), grown highest degree first.
+		uint8_t generator[EccLength + 1] = { 1 };
+		for (int i = 0; i < EccLength; i++) {
+			for (int j = i + 1; j > 0; j--) {
+				uint8_t shifted = generator[j - 1] == 0 ? 0 : t.exp[(t.log[generator[j - 1]] + i) % 255];
+				generator[j] ^= shifted;
+			}
+		}
+		for (int j = 0; j <= EccLength; j++) {
+			t.generatorLog[j] = t.log[generator[j]];
+		}
+		for (int i = 0; i < EccLength; i++) {
+			for (int k = 0; k < LENGTH; k++) {
+				t.syndromeLog[i][k] = (uint8_t)(i * (LENGTH - 1 - k) % 255);
+			}
+		}
+		return t;
+	}
+};
+
+/* The code of RS::ReedSolomon<MessageLength, EccLength>: GF(256) with the 0x11d
+ * polynomial, generator roots 2^0 .. 2^(EccLength - 1), the codeword is the message
+ * followed by the correction bytes, highest degree first. Encode() gives the same
+ * codewords and Decode() corrects the same errors.
+ *
+ * Everything that only depends on the code is computed by the compiler: the exp and
+ * log tables, the generator polynomial and the powers of the generator used by each
+ * syndrome. The loops all have fixed trip counts, the buffers are fixed size arrays on
+ * the stack, and there is no state at all outside of a call: the codec is used through
+ * static functions, from any number of threads.
+ *
+ * Unlike RS::ReedSolomon, a codeword is rejected when the error locator does not have
+ * as many roots among the codeword positions as its degree, instead of being
+ * "corrected" at the roots that were found, and erasures alone are corrected.
+ */
+template <int MessageLength, int EccLength>
+class ReedSolomonCodec {
+public:
+	static const int LENGTH = MessageLength + EccLength;
+
+	/* The field and the code, also used by the batch CodeDecoder. */
+	static constexpr ReedSolomonTables<MessageLength, EccLength> tables = ReedSolomonTables<MessageLength, EccLength>::make();
+
+	/* codeword receives the LENGTH bytes of the encoded message. */
+	static void encode(const uint8_t* message, uint8_t* codeword) {
+		uint8_t remainder[LENGTH];
+		memcpy(remainder, message, MessageLength);
+		memset(remainder + MessageLength, 0, EccLength);
+		for (int i = 0; i < MessageLength; i++) {
+			uint8_t coefficient = remainder[i];
+			if (coefficient != 0) {
+				int l = tables.log[coefficient];
+				for (int j = 1; j <= EccLength; j++) {
+					remainder[i + j] ^= tables.exp[l + tables.generatorLog[j]];
+				}
+			}
+		}
+		memcpy(codeword, message, MessageLength);
+		memcpy(codeword + MessageLength, remainder + MessageLength, EccLength);
+	}
+
+	/* Fills the EccLength syndromes of the codeword, all zero for a valid codeword. */
+	static void syndromes(const uint8_t* codeword, uint8_t* syndrome) {
+		for (int i = 0; i < EccLength; i++) {
+			syndrome[i] = 0;
+		}
+		for (int k = 0; k < LENGTH; k++) {
+			if (codeword[k] != 0) {
+				int l = tables.log[codeword[k]];
+				for (int i = 0; i < EccLength; i++) {
+					syndrome[i] ^= tables.exp[l + tables.syndromeLog[i][k]];
+				}
+			}
+		}
+	}
+
+	/* Corrects up to EccLength erasures and errors, 2 * errors + erasures <= EccLength.
+	 * The erasures are the positions in the codeword of bytes known to be wrong. The
+	 * message of an invalid codeword is left as the first bytes of the codeword. */
+	static CodeStatus decode(const uint8_t* codeword, uint8_t* message,
+	                         const uint8_t* erasures = NULL, int erasureCount = 0) {
+		uint8_t syndrome[EccLength];
+		syndromes(codeword, syndrome);
+		uint8_t any = 0;
+		for (int i = 0; i < EccLength; i++) {
+			any |= syndrome[i];
+		}
+		memcpy(message, codeword, MessageLength);
+		if (any == 0) {
+			return CODE_VALID;
+		}
+		if (erasureCount > EccLength) {
+			return CODE_INVALID;
+		}
+
+		// Polynomials are lowest degree first from here on. Erasure locator
+		// Gamma(x) = prod(1 - X x), X = 2^degree of the erased byte.
+		uint8_t gamma[EccLength + 1] = { 1 };
+		for (int e = 0; e < erasureCount; e++) {
+			if (erasures[e] >= LENGTH) {
+				return CODE_INVALID;
+			}
+			int l = LENGTH - 1 - erasures[e];
+			for (int i = e + 1; i > 0; i--) {
+				gamma[i] ^= mul(gamma[i - 1], l);
+			}
+		}
+
+		// Berlekamp-Massey on the Forney syndromes, where the erasures are taken out.
+		const int count = EccLength - erasureCount;
+		uint8_t forney[EccLength];
+		for (int j = 0; j < count; j++) {
+			uint8_t t = 0;
+			for (int i = 0; i <= erasureCount; i++) {
+				t ^= product(gamma[i], syndrome[j + erasureCount - i]);
+			}
+			forney[j] = t;
+		}
+		uint8_t sigma[EccLength + 1] = { 1 };
+		uint8_t previous[EccLength + 1] = { 1 };
+		int errors = 0, shift = 1;
+		uint8_t previousDelta = 1;
+		for (int r = 0; r < count; r++) {
+			uint8_t delta = forney[r];
+			for (int i = 1; i <= errors; i++) {
+				delta ^= product(sigma[i], forney[r - i]);
+			}
+			if (delta == 0) {
+				shift++;
+				continue;
+			}
+			uint8_t scale = quotient(delta, previousDelta);
+			uint8_t updated[EccLength + 1];
+			memcpy(updated, sigma, sizeof(updated));
+			for (int i = shift; i <= EccLength; i++) {
+				updated[i] ^= product(scale, previous[i - shift]);
+			}
+			if (2 * errors <= r) {
+				memcpy(previous, sigma, sizeof(previous));
+				errors = r + 1 - errors;
+				previousDelta = delta;
+				shift = 1;
+			} else {
+				shift++;
+			}
+			memcpy(sigma, updated, sizeof(sigma));
+		}
+		if (2 * errors + erasureCount > EccLength) {
+			return CODE_INVALID;
+		}
+
+		// Errata locator Lambda = Sigma Gamma, its roots are the inverses of the X.
+		const int degree = errors + erasureCount;
+		uint8_t lambda[EccLength + 1] = { 0 };
+		for (int i = 0; i <= errors; i++) {
+			for (int j = 0; j <= erasureCount; j++) {
+				lambda[i + j] ^= product(sigma[i], gamma[j]);
+			}
+		}
+		uint8_t positions[EccLength];
+		int found = 0;
+		for (int k = 0; k < LENGTH; k++) {
+			if (evaluate(lambda, degree, inverseLog(LENGTH - 1 - k)) == 0) {
+				positions[found++] = (uint8_t)k;
+			}
+		}
+		if (found != degree) {
+			return CODE_INVALID;
+		}
+
+		// Forney: the error at X is X Omega(1/X) / Lambda'(1/X), with the evaluator
+		// Omega = S Lambda mod x^EccLength.
+		uint8_t omega[EccLength];
+		for (int i = 0; i < EccLength; i++) {
+			uint8_t t = 0;
+			for (int j = 0; j <= i && j <= degree; j++) {
+				t ^= product(syndrome[i - j], lambda[j]);
+			}
+			omega[i] = t;
+		}
+		uint8_t derivative[EccLength] = { 0 };
+		for (int i = 1; i <= degree; i += 2) {
+			derivative[i - 1] = lambda[i];
+		}
+		uint8_t corrected[LENGTH];
+		memcpy(corrected, codeword, LENGTH);
+		for (int e = 0; e < found; e++) {
+			int l = LENGTH - 1 - positions[e];
+			int inverse = inverseLog(l);
+			uint8_t denominator = evaluate(derivative, degree - 1, inverse);
+			if (denominator == 0) {
+				return CODE_INVALID;
+			}
+			uint8_t numerator = mul(evaluate(omega, EccLength - 1, inverse), l);
+			corrected[positions[e]] ^= quotient(numerator, denominator);
+		}
+		memcpy(message, corrected, MessageLength);
+		return CODE_CORRECTED;
+	}
+
+private:
+	/* x 2^l */
+	static uint8_t mul(uint8_t x, int l) {
+		return x == 0 ? 0 : tables.exp[tables.log[x] + l];
+	}
+
+	static uint8_t product(uint8_t x, uint8_t y) {
+		return x == 0 || y == 0 ? 0 : tables.exp[tables.log[x] + tables.log[y]];
+	}
+
+	static uint8_t quotient(uint8_t x, uint8_t y) {
+		return x == 0 ? 0 : tables.exp[tables.log[x] + 255 - tables.log[y]];
+	}
+
+	/* Log of 1 / 2^l, l in [0, 255). */
+	static int inverseLog(int l) {
+		return l == 0 ? 0 : 255 - l;
+	}
+
+	/* p(2^l), p lowest degree first. */
+	static uint8_t evaluate(const uint8_t* p, int degree, int l) {
+		uint8_t y = 0;
+		for (int i = degree; i >= 0; i--) {
+			y = mul(y, l) ^ p[i];
+		}
+		return y;
+	}
+};
+
+template <int MessageLength, int EccLength>
+constexpr ReedSolomonTables<MessageLength, EccLength> ReedSolomonCodec<MessageLength, EccLength>::tables;
+
+} /* End of namespace marker */
+
+#endif /* SRC_CODEC_H_ */
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "codes.h"
+#include <string.h>
+
+/* The SSSE3 syndromes are compiled for their own target and only used when the CPU
+ * running the program supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CODE_SYNDROMES_X86
+#include <immintrin.h>
+#endif
+
+namespace marker {
+
+namespace {
+
+/* x y in the field of MarkerCodec. */
+inline uint8_t product(uint8_t x, uint8_t y) {
+    return x == 0 || y == 0 ? 0 : MarkerCodec::tables.exp[MarkerCodec::tables.log[x] + MarkerCodec::tables.log[y]];
+}
+
+} /* End of anonymous namespace */
+
+CodeDecoder::CodeDecoder() : ssse3(false) {
+    // The codeword is evaluated, highest degree first, at 2^i for syndrome i.
+    for (int i = 0; i < CODE_ECC_LENGTH; i++) {
+        for (int k = 0; k < CODE_LENGTH; k++) {
+            uint8_t factor = MarkerCodec::tables.exp[MarkerCodec::tables.syndromeLog[i][k]];
+            factors[i][k] = factor;
+            for (int n = 0; n < 16; n++) {
+                lowProducts[i][k][n] = product(factor, n);
+                highProducts[i][k][n] = product(factor, n << 4);
+            }
+        }
+    }
+#ifdef CODE_SYNDROMES_X86
+    __builtin_cpu_init();
+    ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+unsigned CodeDecoder::syndromesScalar(const uint8_t* codewords, int count) const {
+    unsigned nonZero = 0;
+    for (int c = 0; c < count; c++) {
+        const uint8_t* codeword = codewords + c * CODE_LENGTH;
+        uint8_t any = 0;
+        for (int i = 0; i < CODE_ECC_LENGTH; i++) {
+            uint8_t syndrome = 0;
+            for (int k = 0; k < CODE_LENGTH; k++) {
+                syndrome ^= product(factors[i][k], codeword[k]);
+            }
+            any |= syndrome;
+        }
+        nonZero |= any ? 1u << c : 0;
+    }
+    return nonZero;
+}
+
+#ifdef CODE_SYNDROMES_X86
+
+__attribute__((target("ssse3")))
+unsigned CodeDecoder::syndromesSSSE3(const uint8_t* codewords, int count) const {
+    // Byte k of the 16 codewords in columns[k], the missing codewords are zeros.
+    uint8_t columns[CODE_LENGTH][16];
+    memset(columns, 0, sizeof(columns));
+    for (int c = 0; c < count; c++) {
+        for (int k = 0; k < CODE_LENGTH; k++) {
+            columns[k][c] = codewords[c * CODE_LENGTH + k];
+        }
+    }
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i syndromes[CODE_ECC_LENGTH];
+    for (int i = 0; i < CODE_ECC_LENGTH; i++) {
+        syndromes[i] = _mm_setzero_si128();
+    }
+    for (int k = 0; k < CODE_LENGTH; k++) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)columns[k]);
+        __m128i low = _mm_and_si128(bytes, nibble);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+        for (int i = 0; i < CODE_ECC_LENGTH; i++) {
+            __m128i lowProduct = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)lowProducts[i][k]), low);
+            __m128i highProduct = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)highProducts[i][k]), high);
+            syndromes[i] = _mm_xor_si128(syndromes[i], _mm_xor_si128(lowProduct, highProduct));
+        }
+    }
+    __m128i any = syndromes[0];
+    for (int i = 1; i < CODE_ECC_LENGTH; i++) {
+        any = _mm_or_si128(any, syndromes[i]);
+    }
+    unsigned zero = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128()));
+    return ~zero & ((1u << count) - 1);
+}
+
+#else
+
+unsigned CodeDecoder::syndromesSSSE3(const uint8_t* codewords, int count) const {
+    return syndromesScalar(codewords, count);
+}
+
+#endif /* CODE_SYNDROMES_X86 */
+
+CodeStatus decodeWithErasures(const uint8_t* codeword, const uint8_t* confidence, uint8_t* message) {
+    // Positions of the weak bytes, the weakest first.
+    uint8_t erasures[CODE_LENGTH];
+    int weak = 0;
+    for (int k = 0; k < CODE_LENGTH; k++) {
+        if (confidence[k] < CODE_WEAK_CONFIDENCE) {
+            int i = weak++;
+            for (; i > 0 && confidence[erasures[i - 1]] > confidence[k]; i--) {
+                erasures[i] = erasures[i - 1];
+            }
+            erasures[i] = (uint8_t)k;
+        }
+    }
+    weak = weak < CODE_MAX_ERASURES ? weak : CODE_MAX_ERASURES;
+    for (int count = 1; count <= weak; count++) {
+        if (MarkerCodec::decode(codeword, message, erasures, count) == CODE_INVALID) {
+            continue;
+        }
+        // Errors corrected outside of the erased bytes.
+        uint8_t corrected[CODE_LENGTH];
+        MarkerCodec::encode(message, corrected);
+        int errors = 0;
+        for (int k = 0; k < CODE_LENGTH; k++) {
+            bool erased = false;
+            for (int e = 0; e < count; e++) {
+                erased = erased || erasures[e] == k;
+            }
+            errors += corrected[k] != codeword[k] && !erased ? 1 : 0;
+        }
+        if (2 * errors + count < CODE_ECC_LENGTH) {
+            return CODE_CORRECTED;
+        }
+    }
+    memcpy(message, codeword, CODE_MESSAGE_LENGTH);
+    return CODE_INVALID;
+}
+
+int CodeDecoder::decode(const uint8_t* codewords, uint8_t* messages, CodeStatus* status, int count) const {
+    int decoded = 0;
+    for (int first = 0; first < count; first += 16) {
+        int batch = count - first < 16 ? count - first : 16;
+        const uint8_t* batchCodewords = codewords + first * CODE_LENGTH;
+        unsigned nonZero = ssse3 ? syndromesSSSE3(batchCodewords, batch) : syndromesScalar(batchCodewords, batch);
+        for (int c = 0; c < batch; c++) {
+            const uint8_t* codeword = batchCodewords + c * CODE_LENGTH;
+            uint8_t* message = messages + (first + c) * CODE_MESSAGE_LENGTH;
+            memcpy(message, codeword, CODE_MESSAGE_LENGTH);
+            if ((nonZero & (1u << c)) == 0) {
+                status[first + c] = CODE_VALID;
+                decoded++;
+                continue;
+            }
+            status[first + c] = MarkerCodec::decode(codeword, message);
+            decoded += status[first + c] != CODE_INVALID ? 1 : 0;
+        }
+    }
+    return decoded;
+}
+
+} /* End of namespace marker */
@@ -0,0 +1,94 @@
+/*
+ * Reed-Solomon decoding of the marker codes, many codewords at a time.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_CODES_H_
+#define SRC_CODES_H_
+
+#include <stdint.h>
+#include "codec.h"
+
+namespace marker {
+
+/* A marker code is a RS(10, 4) codeword: 4 bytes of message and 6 of correction. */
+const int CODE_LENGTH = 10;
+const int CODE_MESSAGE_LENGTH = 4;
+const int CODE_ECC_LENGTH = CODE_LENGTH - CODE_MESSAGE_LENGTH;
+
+typedef ReedSolomonCodec<CODE_MESSAGE_LENGTH, CODE_ECC_LENGTH> MarkerCodec;
+
+/* Bytes with a confidence below CODE_WEAK_CONFIDENCE grey levels may be erased, at most
+ * CODE_MAX_ERASURES of them. */
+const int CODE_WEAK_CONFIDENCE = 16;
+const int CODE_MAX_ERASURES = 4;
+
+/* Second chance for a codeword that did not decode: the weakest byte is erased, then the
+ * two weakest, and so on up to CODE_MAX_ERASURES bytes, as long as they are below
+ * CODE_WEAK_CONFIDENCE. An erased byte costs one correction byte instead of two for an
+ * error, so more of the wrong bytes can be corrected when they are among the weak ones.
+ *
+ * The more bytes are erased, the more likely a random codeword decodes: with 4
+ * erasures and one error, 2% of them would. A result is only kept when one correction
+ * byte is left unused, 2 * errors + erasures < CODE_ECC_LENGTH, which keeps it around 1
+ * in 10000 over all the attempts.
+ *
+ * confidence holds one value per byte of the codeword, see Marker::codeConfidence.
+ * Returns CODE_CORRECTED or CODE_INVALID. */
+CodeStatus decodeWithErasures(const uint8_t* codeword, const uint8_t* confidence, uint8_t* message);
+
+/* Decodes the same way as MarkerCodec::decode, with the same results, but for a whole
+ * batch of codewords.
+ *
+ * The syndromes are linear in the codeword bytes, each one is a sum of the bytes
+ * multiplied by constant powers of the generator. With SSSE3 the codewords are
+ * transposed 16 at a time so that each byte position fills a vector, and each
+ * multiplication by a constant is two PSHUFB lookups: one in a table of the products
+ * of the low nibbles, one in a table of the products of the high nibbles. Most of the
+ * codewords read from clean markers have no error, only those with a non-zero syndrome
+ * go through the Berlekamp-Massey and Forney steps of MarkerCodec.
+ *
+ * The tables belong to the decoder, built by the constructor: a decoder is not shared
+ * between threads, each Scanner has its own.
+ */
+class CodeDecoder {
+public:
+	CodeDecoder();
+
+	/* The codewords are CODE_LENGTH bytes each and the messages CODE_MESSAGE_LENGTH bytes
+	 * each, both packed. The message of an invalid codeword is left as the first bytes
+	 * of the codeword. Returns the number of valid and corrected codewords. */
+	int decode(const uint8_t* codewords, uint8_t* messages, CodeStatus* status, int count) const;
+
+	/* "ssse3" or "scalar" for the syndromes. */
+	const char* isa() const { return ssse3 ? "ssse3" : "scalar"; }
+
+private:
+	/* Returns a bit per codeword, among the first count <= 16, with a non-zero syndrome. */
+	unsigned syndromesScalar(const uint8_t* codewords, int count) const;
+	unsigned syndromesSSSE3(const uint8_t* codewords, int count) const;
+
+	bool ssse3;
+	/* Power of the generator multiplying byte k of the codeword in syndrome i. */
+	uint8_t factors[CODE_ECC_LENGTH][CODE_LENGTH];
+	/* The products of the factors by the low and high nibbles, for PSHUFB. */
+	uint8_t lowProducts[CODE_ECC_LENGTH][CODE_LENGTH][16];
+	uint8_t highProducts[CODE_ECC_LENGTH][CODE_LENGTH][16];
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_CODES_H_ */
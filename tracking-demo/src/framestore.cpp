@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "framestore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace marker {
+
+namespace {
+
+const char MAGIC[8] = { 'M', 'K', 'F', 'R', 'A', 'M', 'E', 'S' };
+const uint32_t VERSION = 1;
+const size_t PAGE = 4096;
+const size_t ROW_ALIGNMENT = 64;
+
+struct Header {
+    char     magic[8];
+    uint32_t version;
+    int32_t  type;
+    int32_t  width;
+    int32_t  height;
+    uint64_t stride;      // Bytes per row
+    uint64_t frameBytes;  // Bytes per frame, rows and padding
+    uint64_t frameCount;
+    uint64_t dataOffset;  // First frame
+    uint64_t indexOffset; // frameCount timestamps
+};
+
+size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+bool supportedType(int type) {
+    return type == CV_8UC1 || type == CV_8UC2 || type == CV_8UC3;
+}
+
+/* The supported types have 8 bits channels. */
+size_t rowBytes(int width, int type) {
+    return (size_t)width * CV_MAT_CN(type);
+}
+
+} /* End of anonymous namespace */
+
+FrameStoreWriter::FrameStoreWriter()
+    : file(NULL), frameType(CV_8UC1), stride(0), frameBytes(0) {
+}
+
+FrameStoreWriter::~FrameStoreWriter() {
+    close();
+}
+
+bool FrameStoreWriter::fail(const std::string& message) {
+    lastError = message + (errno != 0 ? std::string(": ") + strerror(errno) : std::string());
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+    return false;
+}
+
+bool FrameStoreWriter::open(const std::string& path, cv::Size size, int type) {
+    close();
+    lastError.clear();
+    timestamps.clear();
+    errno = 0;
+    if (!supportedType(type) || size.width <= 0 || size.height <= 0) {
+        return fail("Only grey, YUYV and BGR frames can be stored");
+    }
+    frameSize = size;
+    frameType = type;
+    stride = alignUp(rowBytes(size.width, type), ROW_ALIGNMENT);
+    frameBytes = alignUp(stride * size.height, PAGE);
+    padding.assign(frameBytes - stride * (size.height - 1) - rowBytes(size.width, type), 0);
+    file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        return fail("Cannot create " + path);
+    }
+    // The header is written last, once the frames are counted: an empty page for now.
+    std::vector<uchar> page(PAGE, 0);
+    if (fwrite(&page[0], 1, PAGE, file) != PAGE) {
+        return fail("Cannot write " + path);
+    }
+    return true;
+}
+
+bool FrameStoreWriter::write(const cv::Mat& frame, int64_t timestampUs) {
+    if (file == NULL) {
+        return false;
+    }
+    if (frame.size() != frameSize || frame.type() != frameType) {
+        errno = 0;
+        lastError = "The frame does not have the size or the type of the store";
+        return false;
+    }
+    const size_t bytes = rowBytes(frameSize.width, frameType);
+    errno = 0;
+    for (int y = 0; y < frameSize.height; y++) {
+        // The padding of the rows, then the padding of the frame after the last row.
+        size_t pad = y + 1 < frameSize.height ? stride - bytes : padding.size();
+        if (fwrite(frame.ptr(y), 1, bytes, file) != bytes
+         || (pad > 0 && fwrite(&padding[0], 1, pad, file) != pad)) {
+            return fail("Cannot write a frame");
+        }
+    }
+    timestamps.push_back(timestampUs);
+    return true;
+}
+
+bool FrameStoreWriter::close() {
+    if (file == NULL) {
+        return false;
+    }
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.type = frameType;
+    header.width = frameSize.width;
+    header.height = frameSize.height;
+    header.stride = stride;
+    header.frameBytes = frameBytes;
+    header.frameCount = timestamps.size();
+    header.dataOffset = PAGE;
+    header.indexOffset = PAGE + frameBytes * timestamps.size();
+    errno = 0;
+    if ((!timestamps.empty() && fwrite(&timestamps[0], sizeof(int64_t), timestamps.size(), file) != timestamps.size())
+     || fseeko(file, 0, SEEK_SET) != 0
+     || fwrite(&header, sizeof(header), 1, file) != 1) {
+        return fail("Cannot write the index");
+    }
+    if (fclose(file) != 0) {
+        file = NULL;
+        return fail("Cannot close the store");
+    }
+    file = NULL;
+    return true;
+}
+
+FrameStoreReader::FrameStoreReader()
+    : base(NULL), length(0), frameType(CV_8UC1), stride(0), frameBytes(0), dataOffset(0), index(NULL),
+      frameCount(0), next(0) {
+}
+
+FrameStoreReader::~FrameStoreReader() {
+    close();
+}
+
+bool FrameStoreReader::fail(const std::string& message) {
+    lastError = message + (errno != 0 ? std::string(": ") + strerror(errno) : std::string());
+    close();
+    return false;
+}
+
+bool FrameStoreReader::open(const std::string& path) {
+    close();
+    lastError.clear();
+    errno = 0;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return fail("Cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(Header)) {
+        ::close(fd);
+        return fail("Not a frame store: " + path);
+    }
+    length = (size_t)st.st_size;
+    // Private and writable: a frame written to by mistake is copied, not the file.
+    void* start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (start == MAP_FAILED) {
+        length = 0;
+        return fail("Cannot map " + path);
+    }
+    base = (uchar*)start;
+
+    Header header;
+    memcpy(&header, base, sizeof(header));
+    errno = 0;
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+        return fail("Not a frame store: " + path);
+    }
+    if (!supportedType(header.type) || header.width <= 0 || header.height <= 0
+     || header.stride < rowBytes(header.width, header.type)
+     || header.frameBytes < header.stride * header.height
+     || header.dataOffset < sizeof(header) || header.dataOffset % sizeof(int64_t) != 0
+     || header.indexOffset % sizeof(int64_t) != 0
+     || header.dataOffset > length
+     || header.frameCount > (length - header.dataOffset) / header.frameBytes
+     || header.indexOffset < header.dataOffset + header.frameCount * header.frameBytes
+     || header.indexOffset > length
+     || header.frameCount > (length - header.indexOffset) / sizeof(int64_t)) {
+        return fail("Corrupted frame store: " + path);
+    }
+    frameSize = cv::Size(header.width, header.height);
+    frameType = header.type;
+    stride = header.stride;
+    frameBytes = header.frameBytes;
+    dataOffset = header.dataOffset;
+    index = (const int64_t*)(base + header.indexOffset);
+    frameCount = (long)header.frameCount;
+    next = 0;
+    // Start reading the frames in now. No MADV_SEQUENTIAL: the pages must stay cached for
+    // the next replay of the store.
+    madvise(base, length, MADV_WILLNEED);
+    return true;
+}
+
+void FrameStoreReader::close() {
+    if (base != NULL) {
+        munmap(base, length);
+        base = NULL;
+    }
+    length = 0;
+    index = NULL;
+    frameCount = 0;
+    next = 0;
+}
+
+cv::Mat FrameStoreReader::frame(long i) const {
+    if (i < 0 || i >= frameCount) {
+        return cv::Mat();
+    }
+    return cv::Mat(frameSize, frameType, base + dataOffset + frameBytes * i, stride);
+}
+
+int64_t FrameStoreReader::timestampUs(long i) const {
+    return i >= 0 && i < frameCount ? index[i] : 0;
+}
+
+bool FrameStoreReader::read(cv::Mat& frame) {
+    if (next >= frameCount) {
+        return false;
+    }
+    frame = this->frame(next++);
+    return true;
+}
+
+} /* End of namespace marker */
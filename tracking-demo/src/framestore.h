@@ -0,0 +1,124 @@
+/*
+ * Uncompressed frame store: recorded sessions replayed from memory, without a decoder.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_FRAMESTORE_H_
+#define SRC_FRAMESTORE_H_
+
+#include <opencv2/core.hpp>
+#include <cstdio>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace marker {
+
+/* A frame store holds frames of the same size and type, grey (CV_8UC1), YUYV (CV_8UC2)
+ * or BGR (CV_8UC3), as they are in memory:
+ *
+ *   header   a page: the magic "MKFRAMES", the version, the type and size of the
+ *            frames, their stride and the offsets below, in the byte order of the host
+ *   frames   back to back from the second page, each one in a whole number of pages,
+ *            its rows padded to a multiple of 64 bytes
+ *   index    after the frames, the timestamp of each frame in microseconds
+ *
+ * Replaying a video through cv::VideoCapture mostly measures the codec. A store is read
+ * through a mapping of the file instead, each frame is a view of the page cache, so that
+ * a benchmark of the scanner only measures the scanner.
+ */
+class FrameStoreWriter {
+public:
+	FrameStoreWriter();
+	~FrameStoreWriter();
+
+	/* Starts a store of frames of the given size and type. Returns false on failure, the
+	 * reason is in error(). */
+	bool open(const std::string& path, cv::Size size, int type);
+	/* Appends a frame, it must have the size and type of the store. */
+	bool write(const cv::Mat& frame, int64_t timestampUs);
+	/* Writes the index and the header: until then the file is not a valid store. */
+	bool close();
+	bool isOpened() const { return file != NULL; }
+
+	long count() const { return (long)timestamps.size(); }
+	const std::string& error() const { return lastError; }
+
+private:
+	FrameStoreWriter(const FrameStoreWriter&);
+	FrameStoreWriter& operator=(const FrameStoreWriter&);
+
+	bool fail(const std::string& message);
+
+	FILE*                file;
+	cv::Size             frameSize;
+	int                  frameType;
+	size_t               stride;
+	size_t               frameBytes;
+	std::vector<int64_t> timestamps;
+	std::vector<uchar>   padding;
+	std::string          lastError;
+};
+
+class FrameStoreReader {
+public:
+	FrameStoreReader();
+	~FrameStoreReader();
+
+	/* Maps the store in memory. Returns false when the file is not a store or cannot be
+	 * read, the reason is in error(). */
+	bool open(const std::string& path);
+	void close();
+	bool isOpened() const { return base != NULL; }
+
+	long count() const { return frameCount; }
+	cv::Size size() const { return frameSize; }
+	int type() const { return frameType; }
+
+	/* Frame number i, as a view of the mapping: no pixel is copied. The view is valid until
+	 * close(). Writing to it only changes a private copy of the page. */
+	cv::Mat frame(long i) const;
+	int64_t timestampUs(long i) const;
+
+	/* The frames in order, returns false after the last one. */
+	bool read(cv::Mat& frame);
+	void rewind() { next = 0; }
+
+	const std::string& error() const { return lastError; }
+
+private:
+	FrameStoreReader(const FrameStoreReader&);
+	FrameStoreReader& operator=(const FrameStoreReader&);
+
+	bool fail(const std::string& message);
+
+	uchar*         base;
+	size_t         length;
+	cv::Size       frameSize;
+	int            frameType;
+	size_t         stride;
+	size_t         frameBytes;
+	size_t         dataOffset;
+	const int64_t* index;
+	long           frameCount;
+	long           next;
+	std::string    lastError;
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_FRAMESTORE_H_ */
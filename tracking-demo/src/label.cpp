@@ -1,59 +1,370 @@
 /* Optimized label code */
 #include "marker.h"
-#include "emmintrin.h"
+#include <stdint.h>
+#include <string.h>
+
+/* The SSE2, AVX2 and AVX-512 kernels are compiled for their own target and only
+ * selected when the CPU running the program supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LABEL_KERNELS_X86
+#include <immintrin.h>
+#endif
+
 namespace marker {
 
-void Scanner::ccLabels(cv::Mat& _src, cv::Mat& _dst) {
-    int i, j, j_scalar = 0;
-    uchar tab[256];
-    Size roi = _src.size();
-    roi.width *= _src.channels();
-    size_t src_step = _src.step;
-    size_t dst_step = _dst.step;
+namespace {
 
-    if( _src.isContinuous() && _dst.isContinuous() )
-    {
-        roi.width *= roi.height;
-        roi.height = 1;
-        src_step = dst_step = roi.width;
+void thresholdScalar(const uchar* src, uchar* dst, int width, int threshold) {
+    for (int x = 0; x < width; x++) {
+        dst[x] = src[x] > threshold ? 1 : 0;
     }
-    int thresh = 12;
-    int maxval = 1;
-    __m128i _x80 = _mm_set1_epi8('\x80');
-    __m128i thresh_u = _mm_set1_epi8(thresh);
-    __m128i thresh_s = _mm_set1_epi8(thresh ^ 0x80);
-    __m128i maxval_ = _mm_set1_epi8(maxval);
-    j_scalar = roi.width & -8;
+}
 
-    for( i = 0; i < roi.height; i++ )
-    {
-        const uchar* src = _src.ptr() + src_step*i;
-        uchar* dst = _dst.ptr() + dst_step*i;
+int runStartsScalar(const uchar* row, int width, int* starts) {
+    int count = 0;
+    for (int x = 1; x < width; x++) {
+        if ((row[x] != 0) != (row[x - 1] != 0)) {
+            starts[count++] = x;
+        }
+    }
+    return count;
+}
 
-		for( j = 0; j <= roi.width - 32; j += 32 )
-		{
-			__m128i v0, v1;
-			v0 = _mm_loadu_si128( (const __m128i*)(src + j) );
-			v1 = _mm_loadu_si128( (const __m128i*)(src + j + 16) );
-			v0 = _mm_cmpgt_epi8( _mm_xor_si128(v0, _x80), thresh_s );
-			v1 = _mm_cmpgt_epi8( _mm_xor_si128(v1, _x80), thresh_s );
-			v0 = _mm_and_si128( v0, maxval_ );
-			v1 = _mm_and_si128( v1, maxval_ );
-			_mm_storeu_si128( (__m128i*)(dst + j), v0 );
-			_mm_storeu_si128( (__m128i*)(dst + j + 16), v1 );
-		}
+/* Stores x + the position of each bit set in the mask. */
+inline int storeBits(uint64_t mask, int x, int* starts) {
+    int count = 0;
+    while (mask) {
+        starts[count++] = x + __builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
 
-		for( ; j <= roi.width - 8; j += 8 )
-		{
-			__m128i v0 = _mm_loadl_epi64( (const __m128i*)(src + j) );
-			v0 = _mm_cmpgt_epi8( _mm_xor_si128(v0, _x80), thresh_s );
-			v0 = _mm_and_si128( v0, maxval_ );
-			_mm_storel_epi64( (__m128i*)(dst + j), v0 );
-		}
+#ifdef LABEL_KERNELS_X86
+
+__attribute__((target("sse2")))
+void thresholdSSE2(const uchar* src, uchar* dst, int width, int threshold) {
+    // No unsigned byte compare in SSE2, flip the sign bits to use the signed one.
+    const __m128i signs = _mm_set1_epi8((char)0x80);
+    const __m128i limit = _mm_set1_epi8((char)(threshold ^ 0x80));
+    const __m128i one = _mm_set1_epi8(1);
+    int x = 0;
+    for (; x <= width - 16; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+        v = _mm_cmpgt_epi8(_mm_xor_si128(v, signs), limit);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_and_si128(v, one));
     }
+    thresholdScalar(src + x, dst + x, width - x, threshold);
 }
 
+__attribute__((target("sse2")))
+int runStartsSSE2(const uchar* row, int width, int* starts) {
+    const __m128i zero = _mm_setzero_si128();
+    int count = 0, x = 1;
+    for (; x <= width - 16; x += 16) {
+        __m128i current = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x)), zero);
+        __m128i previous = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row + x - 1)), zero);
+        count += storeBits((unsigned)_mm_movemask_epi8(_mm_xor_si128(current, previous)), x, starts + count);
+    }
+    for (; x < width; x++) {
+        if ((row[x] != 0) != (row[x - 1] != 0)) {
+            starts[count++] = x;
+        }
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+void thresholdAVX2(const uchar* src, uchar* dst, int width, int threshold) {
+    const __m256i signs = _mm256_set1_epi8((char)0x80);
+    const __m256i limit = _mm256_set1_epi8((char)(threshold ^ 0x80));
+    const __m256i one = _mm256_set1_epi8(1);
+    int x = 0;
+    for (; x <= width - 32; x += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + x));
+        v = _mm256_cmpgt_epi8(_mm256_xor_si256(v, signs), limit);
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_and_si256(v, one));
+    }
+    thresholdScalar(src + x, dst + x, width - x, threshold);
 }
 
+__attribute__((target("avx2")))
+int runStartsAVX2(const uchar* row, int width, int* starts) {
+    const __m256i zero = _mm256_setzero_si256();
+    int count = 0, x = 1;
+    for (; x <= width - 32; x += 32) {
+        __m256i current = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + x)), zero);
+        __m256i previous = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(row + x - 1)), zero);
+        count += storeBits((unsigned)_mm256_movemask_epi8(_mm256_xor_si256(current, previous)), x, starts + count);
+    }
+    for (; x < width; x++) {
+        if ((row[x] != 0) != (row[x - 1] != 0)) {
+            starts[count++] = x;
+        }
+    }
+    return count;
+}
 
+/* AVX-512 masks handle the tails, no scalar loop needed. */
+__attribute__((target("avx512f,avx512bw")))
+void thresholdAVX512(const uchar* src, uchar* dst, int width, int threshold) {
+    const __m512i limit = _mm512_set1_epi8((char)threshold);
+    const __m512i one = _mm512_set1_epi8(1);
+    for (int x = 0; x < width; x += 64) {
+        __mmask64 valid = width - x >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << (width - x)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi8(valid, src + x);
+        __mmask64 above = _mm512_cmpgt_epu8_mask(v, limit);
+        _mm512_mask_storeu_epi8(dst + x, valid, _mm512_maskz_mov_epi8(above, one));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int runStartsAVX512(const uchar* row, int width, int* starts) {
+    int count = 0;
+    for (int x = 1; x < width; x += 64) {
+        __mmask64 valid = width - x >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << (width - x)) - 1);
+        __mmask64 current = _mm512_test_epi8_mask(_mm512_maskz_loadu_epi8(valid, row + x), _mm512_set1_epi8(-1));
+        __mmask64 previous = _mm512_test_epi8_mask(_mm512_maskz_loadu_epi8(valid, row + x - 1), _mm512_set1_epi8(-1));
+        count += storeBits((current ^ previous) & valid, x, starts + count);
+    }
+    return count;
+}
+
+#endif /* LABEL_KERNELS_X86 */
+
+const LabelKernels scalarKernels = { "scalar", thresholdScalar, runStartsScalar };
+#ifdef LABEL_KERNELS_X86
+const LabelKernels sse2Kernels = { "sse2", thresholdSSE2, runStartsSSE2 };
+const LabelKernels avx2Kernels = { "avx2", thresholdAVX2, runStartsAVX2 };
+const LabelKernels avx512Kernels = { "avx512", thresholdAVX512, runStartsAVX512 };
+#endif
+
+} /* End of anonymous namespace */
+
+const LabelKernels* labelKernels(const char* isa) {
+    bool best = isa == NULL || strcmp(isa, "auto") == 0;
+#ifdef LABEL_KERNELS_X86
+    __builtin_cpu_init();
+    if ((best || strcmp(isa, "avx512") == 0) && __builtin_cpu_supports("avx512bw")) {
+        return &avx512Kernels;
+    }
+    if ((best || strcmp(isa, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        return &avx2Kernels;
+    }
+    if ((best || strcmp(isa, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        return &sse2Kernels;
+    }
+#endif
+    if (best || strcmp(isa, "scalar") == 0) {
+        return &scalarKernels;
+    }
+    return NULL;
+}
+
+/* Binarize the grey image with a fixed threshold and label the result, the label
+ * image is written too. Returns the number of labels plus one. */
+int Scanner::ccLabels(cv::Mat& grey, int threshold, cv::Mat& labels) {
+    CV_Assert(grey.type() == CV_8UC1);
+    const LabelKernels* kernels = labeler.getKernels();
+
+    binaryImage.create(grey.rows, grey.cols, CV_8UC1);
+    for (int y = 0; y < grey.rows; y++) {
+        kernels->threshold(grey.ptr<uchar>(y), binaryImage.ptr<uchar>(y), grey.cols, threshold);
+    }
+    int count = labeler.label(binaryImage, componentStats, centroids, components.parent);
+    labeler.draw(labels);
+    return count;
+}
+
+int Labeler::find(std::vector<int>& parent, int run) {
+    int root = run;
+    while (parent[root] != root) {
+        root = parent[root];
+    }
+    // Path compression
+    while (parent[run] != root) {
+        int next = parent[run];
+        parent[run] = root;
+        run = next;
+    }
+    return root;
+}
+
+void Labeler::merge(std::vector<int>& parent, int a, int b) {
+    a = find(parent, a);
+    b = find(parent, b);
+    // The root is always the first run of the component in raster order.
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+void Labeler::mergeRow(Band& band, int y) {
+    const std::vector<Run>& runs = band.runs;
+    int above = band.rowStart[y - 1];
+    for (int current = band.rowStart[y]; current < band.rowStart[y + 1]; current++) {
+        const Run& run = runs[current];
+        while (runs[above].end <= run.start) {
+            above++;
+        }
+        for (int other = above; other < band.rowStart[y] && runs[other].start < run.end; other++) {
+            if (runs[other].white == run.white) {
+                merge(band.parent, other, current);
+            }
+        }
+    }
+}
+
+int Labeler::label(const cv::Mat& binary, cv::Mat& stats, cv::Mat& centroids, std::vector<int>& parents) {
+    CV_Assert(binary.type() == CV_8UC1);
+    beginBands(1, binary.rows, binary.cols);
+    labelBand(0, binary, 0);
+    return endBands(stats, centroids, parents);
+}
+
+void Labeler::beginBands(int count, int rows, int cols) {
+    CV_Assert(count >= 1);
+    if ((int)bands.size() < count) {
+        bands.resize(count);
+    }
+    bandCount = count;
+    this->rows = rows;
+    this->cols = cols;
+}
+
+void Labeler::labelBand(int index, const cv::Mat& binary, int y0) {
+    CV_Assert(binary.type() == CV_8UC1 && binary.cols == cols && index < bandCount);
+    Band& band = bands[index];
+    band.y = y0;
+    band.rows = binary.rows;
+    band.runs.clear();
+    band.parent.clear();
+    band.rowStart.resize(band.rows + 1);
+    band.rowStart[0] = 0;
+    band.starts.resize(cols);
+
+    // Split each row in runs, and merge them with the runs of the same colour they touch
+    // on the previous row.
+    for (int y = 0; y < band.rows; y++) {
+        const uchar* src = binary.ptr<uchar>(y);
+        int count = cols > 0 ? kernels->runStarts(src, cols, &band.starts[0]) : -1;
+        for (int i = 0; i <= count; i++) {
+            Run run;
+            run.start = i > 0 ? band.starts[i - 1] : 0;
+            run.end = i < count ? band.starts[i] : cols;
+            run.y = y0 + y;
+            run.white = src[run.start] != 0;
+            band.parent.push_back((int)band.runs.size());
+            band.runs.push_back(run);
+        }
+        band.rowStart[y + 1] = (int)band.runs.size();
+        if (y > 0) {
+            mergeRow(band, y);
+        }
+    }
+}
+
+int Labeler::endBands(cv::Mat& stats, cv::Mat& centroids, std::vector<int>& parents) {
+    // Append the other bands to the first one. Their union-find roots are still the
+    // first runs of their components within the band, they stay so with the runs
+    // renumbered, then the runs on both sides of each seam are merged like any two rows.
+    Band& image = bands[0];
+    for (int b = 1; b < bandCount; b++) {
+        const Band& band = bands[b];
+        CV_Assert(band.y == image.y + image.rows);
+        const int offset = (int)image.runs.size();
+        image.runs.insert(image.runs.end(), band.runs.begin(), band.runs.end());
+        for (size_t i = 0; i < band.parent.size(); i++) {
+            image.parent.push_back(band.parent[i] + offset);
+        }
+        for (int y = 1; y <= band.rows; y++) {
+            image.rowStart.push_back(band.rowStart[y] + offset);
+        }
+        int seam = image.rows;
+        image.rows += band.rows;
+        if (seam > 0 && band.rows > 0) {
+            mergeRow(image, seam);
+        }
+    }
+    CV_Assert(image.y == 0 && image.rows == rows);
+    std::vector<Run>& runs = image.runs;
+    std::vector<int>& parent = image.parent;
+
+    // Number the components in the order of their first run. The parent of a run always
+    // comes before it, so it already holds its final label when the run is reached. The
+    // run on the left of the first run of a component is in the enclosing component.
+    int count = 1;
+    parents.assign(1, 0);
+    for (int i = 0; i < (int)parent.size(); i++) {
+        if (parent[i] == i) {
+            parent[i] = count++;
+            parents.push_back(runs[i].start > 0 ? parent[i - 1] : 0);
+        } else {
+            parent[i] = parent[parent[i]];
+        }
+    }
+
+    // Accumulate the stats, with the right and bottom sides kept exclusive until the end.
+    // The outputs are views of buffers that only grow: the number of labels changes from
+    // one frame to the next, and create() would re-allocate the outputs every time.
+    if (statsBuffer.rows < count) {
+        int capacity = count + count / 2;
+        statsBuffer.create(capacity, cv::CC_STAT_MAX, CV_32S);
+        centroidsBuffer.create(capacity, 2, CV_64F);
+    }
+    stats = statsBuffer.rowRange(0, count);
+    centroids = centroidsBuffer.rowRange(0, count);
+    stats.setTo(cv::Scalar(0));
+    centroids.setTo(cv::Scalar(0));
+    for (int i = 0; i < (int)runs.size(); i++) {
+        const Run& run = runs[i];
+        int* s = stats.ptr<int>(parent[i]);
+        double* c = centroids.ptr<double>(parent[i]);
+        int length = run.end - run.start;
+        if (s[cv::CC_STAT_AREA] == 0) {
+            s[cv::CC_STAT_LEFT] = run.start;
+            s[cv::CC_STAT_TOP] = run.y;
+            s[cv::CC_STAT_WIDTH] = run.end;
+        } else {
+            if (run.start < s[cv::CC_STAT_LEFT]) {
+                s[cv::CC_STAT_LEFT] = run.start;
+            }
+            if (run.end > s[cv::CC_STAT_WIDTH]) {
+                s[cv::CC_STAT_WIDTH] = run.end;
+            }
+        }
+        s[cv::CC_STAT_HEIGHT] = run.y + 1;
+        s[cv::CC_STAT_AREA] += length;
+        c[0] += (double)(run.start + run.end - 1) * length / 2;
+        c[1] += (double)run.y * length;
+    }
+    for (int label = 1; label < count; label++) {
+        int* s = stats.ptr<int>(label);
+        double* c = centroids.ptr<double>(label);
+        s[cv::CC_STAT_WIDTH] -= s[cv::CC_STAT_LEFT];
+        s[cv::CC_STAT_HEIGHT] -= s[cv::CC_STAT_TOP];
+        c[0] /= s[cv::CC_STAT_AREA];
+        c[1] /= s[cv::CC_STAT_AREA];
+    }
+    return count;
+}
+
+void Labeler::draw(cv::Mat& labels) const {
+    const std::vector<Run>& runs = bands[0].runs;
+    const std::vector<int>& parent = bands[0].parent;
+    const std::vector<int>& rowStart = bands[0].rowStart;
+    labels.create(rows, cols, CV_32S);
+    for (int y = 0; y < rows; y++) {
+        int* dst = labels.ptr<int>(y);
+        for (int i = rowStart[y]; i < rowStart[y + 1]; i++) {
+            int value = parent[i];
+            for (int x = runs[i].start; x < runs[i].end; x++) {
+                dst[x] = value;
+            }
+        }
+    }
+}
 
+} /* End of namespace marker */
@@ -0,0 +1,127 @@
+/*
+ * Connected component labeling of both polarities of a binary image in a
+ * single raster pass.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_LABEL_H_
+#define SRC_LABEL_H_
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace marker {
+
+/* The vectorized parts of the labeling, one set per instruction set. */
+struct LabelKernels {
+	const char* name;
+	/* dst[x] = src[x] > threshold ? 1 : 0 */
+	void (*threshold)(const uchar* src, uchar* dst, int width, int threshold);
+	/* Stores the x of the pixels starting a new run, where the row goes from zero to
+	 * non-zero or back, and returns their number. Pixel 0 is not reported. */
+	int (*runStarts)(const uchar* row, int width, int* starts);
+};
+
+/* The kernels for "scalar", "sse2", "avx2" or "avx512", NULL when the CPU (or the
+ * compiler) does not support that instruction set. NULL or "auto" select the best
+ * kernels for the CPU running the program. */
+const LabelKernels* labelKernels(const char* isa);
+
+/* Labels the white (non-zero) and the black (zero) regions of a binary image with
+ * 4-connectivity, as two calls to cv::connectedComponentsWithStats on the image and its
+ * inverse would, but in one pass and with a single numbering.
+ *
+ * The image is split in horizontal runs of equal pixels, runs touching a run of the same
+ * colour on the previous row are merged with a union-find, and the labels are numbered
+ * from 1 in the raster order of the first pixel of each component.
+ *
+ * The outputs use the cv::connectedComponentsWithStats layout: a CV_32S stats matrix
+ * indexed by cv::CC_STAT_* and CV_64F centroids. Label 0 is not used, its row of stats is
+ * all zeros. The outputs are views of buffers kept by the labeler, only valid until the
+ * next call. The label image itself is only written on request, by draw().
+ *
+ * The labeler also records the containment tree: the parent of a component is the
+ * component on the left of its first pixel, the one it lies in. A parent always has a
+ * smaller label than its children, so going through the labels in decreasing order
+ * visits every component after all of its descendants. Components touching the left side
+ * of the image have no parent (0).
+ *
+ * The image can also be labeled in horizontal bands from several threads, see
+ * labelBand(), with the same results as label().
+ */
+class Labeler {
+public:
+	Labeler() : kernels(labelKernels(NULL)), bandCount(0), rows(0), cols(0) {}
+
+	void setKernels(const LabelKernels* kernels) { this->kernels = kernels; }
+	const LabelKernels* getKernels() const { return kernels; }
+
+	/* Returns the number of rows of the stats, i.e. the number of labels plus one. */
+	int label(const cv::Mat& binary, cv::Mat& stats, cv::Mat& centroids, std::vector<int>& parents);
+
+	/* The same labeling split in count bands of consecutive rows of a rows x cols image:
+	 * beginBands(), then labelBand() for each band, then endBands() for the outputs of
+	 * label(). The bands are labeled on their own, from any thread, one thread per band.
+	 * endBands() joins them in the order of their rows and merges the runs touching
+	 * across each seam, the components and their numbering are then the same as if the
+	 * whole image had been labeled at once. */
+	void beginBands(int count, int rows, int cols);
+	/* binary holds the rows [y, y + binary.rows) of the image. */
+	void labelBand(int band, const cv::Mat& binary, int y);
+	int endBands(cv::Mat& stats, cv::Mat& centroids, std::vector<int>& parents);
+
+	/* Write the CV_32S label image of the last call to label(). */
+	void draw(cv::Mat& labels) const;
+
+private:
+	struct Run {
+		int start;
+		int end; // Exclusive
+		int y;
+		bool white;
+	};
+
+	/* The runs of a band, the first band holds the runs of the whole image once the bands
+	 * are joined. Run and row indices are local to the band. */
+	struct Band {
+		std::vector<int> starts;
+		std::vector<Run> runs;
+		std::vector<int> parent; // Union-find over the runs, then the final label of each run
+		std::vector<int> rowStart;
+		int y;
+		int rows;
+	};
+
+	static int find(std::vector<int>& parent, int run);
+	static void merge(std::vector<int>& parent, int a, int b);
+	/* Merges the runs of row y of the band with those of the same colour they touch on
+	 * row y - 1. */
+	static void mergeRow(Band& band, int y);
+
+	const LabelKernels* kernels;
+
+	/* Scratch buffers, kept from one frame to the next. */
+	std::vector<Band> bands;
+	int bandCount;
+	cv::Mat statsBuffer;
+	cv::Mat centroidsBuffer;
+	int rows;
+	int cols;
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_LABEL_H_ */
@@ -0,0 +1,842 @@
+/*
+ * Headless benchmark for the marker scanner.
+ *
+ * Replays directories of images, single images and video files through
+ * Scanner::findMarkers and reports latency percentiles and throughput as JSON,
+ * so that detection performance can be measured without a camera.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include "batch.h"
+#include "framestore.h"
+#include "marker.h"
+#include "rs.hpp"
+#include "synth.h"
+#include "v4l2.h"
+
+namespace {
+
+/* Heap allocations of the process, for --check-allocations. The cv::Mat buffers are
+ * counted too: OpenCV allocates the UMatData of each new buffer with operator new.
+ * After the warmup, a frame is only expected to allocate when it has more markers or
+ * components (counted with tracing only) than all the frames before it, or when it is
+ * larger: these frames grow the buffers and do not fail the check. */
+std::atomic<long> allocationCounter(0);
+
+long countedAllocations() {
+    return allocationCounter.load(std::memory_order_relaxed);
+}
+
+} /* End of anonymous namespace */
+
+void* operator new(std::size_t size) {
+    allocationCounter.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    int windowSize;
+    int C;
+    int repeat;
+    int warmup;
+    int maxFrames;
+    bool compareKernels;
+    bool checkAllocations;
+    int codecBenchmark; // Codewords decoded by --bench-codec
+    int codecStress; // Codewords encoded and decoded by each thread of --stress-codec
+    int threads;
+    int tileThreads; // Scanner::threads
+    int batchThreads; // BatchScanner pass when above 0
+    int openingSize;
+    int tracking; // Full scan interval, 0 when not tracking
+    int pyramidLevels;
+    std::string kernels;
+    std::string captureFormat; // Inputs read by V4l2Capture when set
+    bool grey; // Grey inputs, scanned through the pointer entry point
+    std::string record; // Frame store written with the frames read
+    int captureWidth;
+    int captureHeight;
+    std::string output;
+    std::string trace;
+    std::vector<std::string> inputs;
+
+    Options() : windowSize(25), C(10), repeat(1), warmup(0), maxFrames(0), compareKernels(false),
+                checkAllocations(false), codecBenchmark(0), codecStress(0), threads(4), tileThreads(1), batchThreads(0),
+                openingSize(1), tracking(0), pyramidLevels(0),
+                kernels("auto"), grey(false), captureWidth(1920), captureHeight(1080) {}
+};
+
+/* Latency samples of one stage of the processing, in microseconds. */
+class LatencySeries {
+public:
+    void add(double us) {
+        samples.push_back(us);
+    }
+
+    size_t count() const {
+        return samples.size();
+    }
+
+    /* Nearest-rank percentile, p in [0, 100]. */
+    double percentile(double p) {
+        if (samples.empty()) {
+            return 0.0;
+        }
+        std::sort(samples.begin(), samples.end());
+        size_t rank = (size_t)(p / 100.0 * samples.size() + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        if (rank > samples.size()) {
+            rank = samples.size();
+        }
+        return samples[rank - 1];
+    }
+
+    double mean() const {
+        double sum = 0.0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            sum += samples[i];
+        }
+        return samples.empty() ? 0.0 : sum / samples.size();
+    }
+
+private:
+    std::vector<double> samples;
+};
+
+/* A source of frames: either a list of image files or a video file. */
+class FrameSource {
+public:
+    FrameSource(const std::string& path, const Options& options) : path(path), grey(options.grey), next(0) {
+        struct stat st;
+        marker::V4l2Capture::Format format;
+        if (marker::V4l2Capture::parseFormat(options.captureFormat, format)) {
+            if (!device.open(path, options.captureWidth, options.captureHeight, format)) {
+                std::cerr << device.error() << std::endl;
+            }
+        } else if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+            cv::glob(path + "/*", files);
+            std::sort(files.begin(), files.end());
+        } else if (store.open(path)) {
+            // Replayed from memory, no decoder in the way.
+        } else if (!cv::imread(path, cv::IMREAD_UNCHANGED).empty()) {
+            files.push_back(path);
+        } else {
+            capture.open(path);
+        }
+    }
+
+    bool isOpened() const {
+        return !files.empty() || capture.isOpened() || device.isOpened() || store.isOpened();
+    }
+
+    /* Fetch the next frame, returns false at the end of the source. A frame of a V4L2
+     * device or raw file is only valid until the next one is read, a frame of a frame
+     * store as long as the source. */
+    bool read(cv::Mat& frame) {
+        if (device.isOpened()) {
+            return device.read(frame);
+        }
+        if (store.isOpened()) {
+            if (!grey) {
+                return store.read(frame);
+            }
+            cv::Mat stored;
+            if (!store.read(stored)) {
+                return false;
+            }
+            if (stored.type() == CV_8UC3) {
+                cv::cvtColor(stored, frame, cv::COLOR_BGR2GRAY);
+            } else {
+                frame = stored;
+            }
+            return true;
+        }
+        if (capture.isOpened()) {
+            if (!grey) {
+                return capture.read(frame);
+            }
+            // The decoder gives BGR, the conversion stands for a camera giving grey frames.
+            if (!capture.read(decoded)) {
+                return false;
+            }
+            cv::cvtColor(decoded, frame, cv::COLOR_BGR2GRAY);
+            return true;
+        }
+        while (next < files.size()) {
+            currentFile = files[next++];
+            frame = cv::imread(currentFile, grey ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR);
+            if (!frame.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Is the source a V4L2 device, whose frames are only valid until the next one? */
+    bool isDevice() const {
+        return device.isOpened() && device.isDevice();
+    }
+
+    std::string path;
+    std::string currentFile; // Empty for videos
+
+private:
+    bool grey;
+    std::vector<std::string> files;
+    size_t next;
+    cv::Mat decoded;
+    cv::VideoCapture capture;
+    marker::V4l2Capture device;
+    marker::FrameStoreReader store;
+};
+
+/* Detection quality against the ground truth written by marker-synth. */
+struct Recall {
+    long truth;
+    long detected;
+    long decoded;
+
+    Recall() : truth(0), detected(0), decoded(0) {}
+};
+
+/* A marker of the ground truth is detected when a marker was found with the
+ * same zero and three corners, and decoded when its code was also read. */
+void matchGroundTruth(const std::vector<marker::GroundTruthMarker>& truth,
+                      const std::vector<marker::Marker>& markers, Recall& recall) {
+    for (size_t t = 0; t < truth.size(); t++) {
+        double tolerance = 0.1 * truth[t].side < 2.0 ? 2.0 : 0.1 * truth[t].side;
+        bool detected = false, decoded = false;
+        for (size_t m = 0; m < markers.size(); m++) {
+            if (cv::norm(markers[m].zero - truth[t].zero) < tolerance
+             && cv::norm(markers[m].three[0] - truth[t].three) < tolerance) {
+                detected = true;
+                decoded = decoded || (markers[m].hasValidCode && memcmp(markers[m].codeValue, truth[t].code, 4) == 0);
+            }
+        }
+        recall.truth++;
+        recall.detected += detected;
+        recall.decoded += decoded;
+    }
+}
+
+/* Decode time per codeword of RS::ReedSolomon and of MarkerCodec. */
+struct CodecBenchmark {
+    double referenceNs;
+    double codecNs;
+    long mismatches;
+
+    CodecBenchmark() : referenceNs(0.0), codecNs(0.0), mismatches(0) {}
+};
+
+/* Random codewords, a quarter of them each with 0, 1, 2 and 3 bytes wrong, all of them
+ * correctable: both decoders must give back the message that was encoded. */
+CodecBenchmark benchmarkCodec(int count) {
+    const int L = marker::CODE_LENGTH, M = marker::CODE_MESSAGE_LENGTH;
+    std::mt19937 generator(1);
+    std::vector<uint8_t> messages(count * M), codewords(count * L), decoded(count * M);
+    for (int c = 0; c < count; c++) {
+        uint8_t* codeword = &codewords[c * L];
+        for (int i = 0; i < M; i++) {
+            messages[c * M + i] = (uint8_t)generator();
+        }
+        marker::MarkerCodec::encode(&messages[c * M], codeword);
+        for (int e = 0; e < c % 4; e++) {
+            // May hit the same byte twice, never more than 3 errors.
+            codeword[generator() % L] ^= (uint8_t)(1 + generator() % 255);
+        }
+    }
+    CodecBenchmark result;
+    Clock::time_point t0 = Clock::now();
+    for (int c = 0; c < count; c++) {
+        uint8_t codeword[L];
+        memcpy(codeword, &codewords[c * L], L);
+        RS::ReedSolomon<M, marker::CODE_ECC_LENGTH> rs;
+        if (rs.Decode(codeword, &decoded[c * M]) != RESULT_SUCCESS
+         || memcmp(&decoded[c * M], &messages[c * M], M) != 0) {
+            result.mismatches++;
+        }
+    }
+    Clock::time_point t1 = Clock::now();
+    for (int c = 0; c < count; c++) {
+        if (marker::MarkerCodec::decode(&codewords[c * L], &decoded[c * M]) == marker::CODE_INVALID) {
+            result.mismatches++;
+        }
+    }
+    Clock::time_point t2 = Clock::now();
+    for (int c = 0; c < count; c++) {
+        if (memcmp(&decoded[c * M], &messages[c * M], M) != 0) {
+            result.mismatches++;
+        }
+    }
+    result.referenceNs = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count() / (double)count;
+    result.codecNs = std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / (double)count;
+    return result;
+}
+
+/* Each thread encodes random messages, corrupts up to 3 bytes of the codewords and
+ * decodes them, with RS::ReedSolomon and MarkerCodec. The threads share one instance of
+ * RS::ReedSolomon, to be run under ThreadSanitizer. Returns the number of codewords
+ * not encoded or decoded as expected. */
+long stressCodec(int threads, int count) {
+    const RS::ReedSolomon<marker::CODE_MESSAGE_LENGTH, marker::CODE_ECC_LENGTH> rs;
+    std::atomic<long> failures(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([&rs, &failures, count, t]() {
+            const int L = marker::CODE_LENGTH, M = marker::CODE_MESSAGE_LENGTH;
+            std::mt19937 generator(t + 1);
+            long failed = 0;
+            for (int c = 0; c < count; c++) {
+                uint8_t message[M], codeword[L], reference[L], decoded[M];
+                for (int i = 0; i < M; i++) {
+                    message[i] = (uint8_t)generator();
+                }
+                rs.Encode(message, codeword);
+                marker::MarkerCodec::encode(message, reference);
+                bool failure = memcmp(codeword, reference, L) != 0;
+                for (int e = 0; e < c % 4; e++) {
+                    codeword[generator() % L] ^= (uint8_t)(1 + generator() % 255);
+                }
+                failure = failure || marker::MarkerCodec::decode(codeword, decoded) == marker::CODE_INVALID
+                    || memcmp(decoded, message, M) != 0;
+                failure = failure || rs.Decode(codeword, decoded) != RESULT_SUCCESS || memcmp(decoded, message, M) != 0;
+                failed += failure ? 1 : 0;
+            }
+            failures += failed;
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    return failures;
+}
+
+double elapsedMicroseconds(Clock::time_point t0, Clock::time_point t1) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count() / 1000.0;
+}
+
+/* Time cv::VideoCapture and the scanner would spend on a captured GREY or YUYV frame,
+ * which the zero-copy capture avoids: the conversion of the buffer to a BGR frame, then
+ * back to grey. */
+double conversionMicroseconds(const cv::Mat& frame, cv::Mat& bgr, cv::Mat& grey) {
+    Clock::time_point t0 = Clock::now();
+    cv::cvtColor(frame, bgr, frame.channels() == 2 ? cv::COLOR_YUV2BGR_YUYV : cv::COLOR_GRAY2BGR);
+    cv::cvtColor(bgr, grey, CV_BGR2GRAY);
+    return elapsedMicroseconds(t0, Clock::now());
+}
+
+/* Throughput of a BatchScanner over all the inputs. */
+struct BatchBenchmark {
+    long frames;
+    long markers;
+    long validCodes;
+    double seconds;
+
+    BatchBenchmark() : frames(0), markers(0), validCodes(0), seconds(0.0) {}
+};
+
+/* The frames are read batchFrames per thread at a time, only the scans are timed. */
+BatchBenchmark benchmarkBatch(const Options& options, const marker::LabelKernels* kernels) {
+    marker::BatchScanner batch(options.batchThreads);
+    batch.openingSize = options.openingSize;
+    batch.pyramidLevels = options.pyramidLevels;
+    batch.setLabelKernels(kernels);
+
+    BatchBenchmark result;
+    std::vector<cv::Mat> frames(batch.batchFrames * batch.threads());
+    std::vector<std::vector<marker::Marker> > results;
+    for (size_t i = 0; i < options.inputs.size(); i++) {
+        FrameSource source(options.inputs[i], options);
+        int count = 1;
+        while (count > 0) {
+            for (count = 0; count < (int)frames.size() && source.read(frames[count]); count++) {
+                if (source.isDevice()) {
+                    frames[count] = frames[count].clone();
+                }
+            }
+            Clock::time_point t0 = Clock::now();
+            batch.scan(&frames[0], count, options.windowSize, options.C, results);
+            result.seconds += elapsedMicroseconds(t0, Clock::now()) / 1e6;
+            for (int f = 0; f < count; f++) {
+                result.frames++;
+                result.markers += results[f].size();
+                for (size_t m = 0; m < results[f].size(); m++) {
+                    result.validCodes += results[f][m].hasValidCode ? 1 : 0;
+                }
+            }
+        }
+        // The frames may be views of the source, about to be closed.
+        for (size_t f = 0; f < frames.size(); f++) {
+            frames[f].release();
+        }
+    }
+    return result;
+}
+
+const char* const KERNEL_NAMES[] = { "scalar", "sse2", "avx2", "avx512" };
+const int KERNEL_COUNT = 4;
+
+/* Times the adaptive threshold of the frame, the fixed threshold and the labeling with the
+ * kernels of each instruction set supported by the CPU. The tests check that they all
+ * give the results of the scalar ones. */
+void compareKernels(const cv::Mat& frame, const cv::Mat& grey, const cv::Mat& binary, const Options& options,
+                    std::vector<marker::AdaptiveThreshold>& thresholders, std::vector<marker::Labeler>& labelers,
+                    std::map<std::string, LatencySeries>& stages) {
+    cv::Mat adaptiveGrey, adaptiveBinary, thresholded, stats, centroids;
+    std::vector<int> parents;
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        // The same threshold kernels may serve several instruction sets, time them once.
+        const marker::ThresholdKernels* windowKernels = marker::thresholdKernels(KERNEL_NAMES[i]);
+        if (windowKernels != NULL && strcmp(windowKernels->name, KERNEL_NAMES[i]) == 0) {
+            thresholders[i].setKernels(windowKernels);
+            Clock::time_point t0 = Clock::now();
+            thresholders[i].apply(frame, adaptiveGrey, adaptiveBinary, options.windowSize, options.C);
+            stages[std::string("kernels.") + windowKernels->name + ".adaptiveThreshold"]
+                .add(elapsedMicroseconds(t0, Clock::now()));
+        }
+
+        const marker::LabelKernels* kernels = marker::labelKernels(KERNEL_NAMES[i]);
+        if (kernels == NULL) {
+            continue;
+        }
+        std::string name = std::string("kernels.") + kernels->name;
+        labelers[i].setKernels(kernels);
+        thresholded.create(grey.rows, grey.cols, CV_8UC1);
+        Clock::time_point t0 = Clock::now();
+        for (int y = 0; y < grey.rows; y++) {
+            kernels->threshold(grey.ptr<uchar>(y), thresholded.ptr<uchar>(y), grey.cols, 127);
+        }
+        Clock::time_point t1 = Clock::now();
+        labelers[i].label(binary, stats, centroids, parents);
+        Clock::time_point t2 = Clock::now();
+        stages[name + ".threshold"].add(elapsedMicroseconds(t0, t1));
+        stages[name + ".label"].add(elapsedMicroseconds(t1, t2));
+    }
+}
+
+std::string jsonString(const std::string& s) {
+    std::string escaped = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            escaped += buffer;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [options] <image-dir|image|video>..." << std::endl
+              << "  --window N      adaptive threshold window size (default 25)" << std::endl
+              << "  --C N           adaptive threshold constant (default 10)" << std::endl
+              << "  --repeat N      replay all the inputs N times (default 1)" << std::endl
+              << "  --warmup N      frames excluded from the statistics (default 0)" << std::endl
+              << "  --max-frames N  stop after N measured frames (default: no limit)" << std::endl
+              << "  --opening N     size of the opening of the binary image, 0 to skip it (default 1)" << std::endl
+              << "  --tracking N    only scan around the markers of the previous frame, full scan every N frames" << std::endl
+              << "  --pyramid N     detect on the frame downsampled N times by 2, read at full resolution" << std::endl
+              << "  --kernels ISA   threshold and labeling kernels: auto, scalar, sse2, avx2 or avx512 (default auto)" << std::endl
+              << "  --compare-kernels  time the threshold and labeling kernels of each instruction set" << std::endl
+              << "  --check-allocations  count the heap allocations of each frame, none are expected after the warmup"
+              << " (unless a frame has more markers or components than any before it, or is larger)" << std::endl
+              << "  --tile-threads N  threads scanning the bands of each frame (default 1)" << std::endl
+              << "  --batch N       scan all the inputs again with a BatchScanner of N threads" << std::endl
+              << "  --capture FMT   read the inputs as V4L2 devices or raw files of GREY or YUYV frames" << std::endl
+              << "  --capture-size WxH  size of the captured frames (default 1920x1080)" << std::endl
+              << "  --record FILE   write the frames read to FILE, a frame store replayed as an input" << std::endl
+              << "  --grey          read the inputs as grey images, scanned in place from their pixels" << std::endl
+              << "  --bench-codec N  time the decoding of N codewords by RS::ReedSolomon and MarkerCodec" << std::endl
+              << "  --stress-codec N  encode and decode N codewords in each thread, sharing the codec" << std::endl
+              << "  --threads N     threads of --stress-codec (default 4)" << std::endl
+              << "  --output FILE   write the JSON report to FILE instead of stdout" << std::endl
+              << "  --trace FILE    dump the scanner stages in the Chrome trace event format" << std::endl;
+}
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--window" && hasValue) {
+            options.windowSize = atoi(argv[++i]);
+        } else if (arg == "--C" && hasValue) {
+            options.C = atoi(argv[++i]);
+        } else if (arg == "--repeat" && hasValue) {
+            options.repeat = atoi(argv[++i]);
+        } else if (arg == "--warmup" && hasValue) {
+            options.warmup = atoi(argv[++i]);
+        } else if (arg == "--max-frames" && hasValue) {
+            options.maxFrames = atoi(argv[++i]);
+        } else if (arg == "--opening" && hasValue) {
+            options.openingSize = atoi(argv[++i]);
+        } else if (arg == "--tracking" && hasValue) {
+            options.tracking = atoi(argv[++i]);
+        } else if (arg == "--pyramid" && hasValue) {
+            options.pyramidLevels = atoi(argv[++i]);
+        } else if (arg == "--kernels" && hasValue) {
+            options.kernels = argv[++i];
+        } else if (arg == "--compare-kernels") {
+            options.compareKernels = true;
+        } else if (arg == "--check-allocations") {
+            options.checkAllocations = true;
+        } else if (arg == "--tile-threads" && hasValue) {
+            options.tileThreads = atoi(argv[++i]);
+        } else if (arg == "--batch" && hasValue) {
+            options.batchThreads = atoi(argv[++i]);
+        } else if (arg == "--capture" && hasValue) {
+            options.captureFormat = argv[++i];
+        } else if (arg == "--capture-size" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.captureWidth, &options.captureHeight) != 2) {
+                std::cerr << "Invalid capture size: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--record" && hasValue) {
+            options.record = argv[++i];
+        } else if (arg == "--grey") {
+            options.grey = true;
+        } else if (arg == "--bench-codec" && hasValue) {
+            options.codecBenchmark = atoi(argv[++i]);
+        } else if (arg == "--stress-codec" && hasValue) {
+            options.codecStress = atoi(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = atoi(argv[++i]);
+        } else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "--trace" && hasValue) {
+            options.trace = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        } else {
+            options.inputs.push_back(arg);
+        }
+    }
+    if (options.windowSize < 3 || (options.windowSize % 2) == 0) {
+        std::cerr << "The window size must be odd and at least 3." << std::endl;
+        return false;
+    }
+    if (options.openingSize < 0 || options.openingSize > 127) {
+        std::cerr << "The opening size must be between 0 and 127." << std::endl;
+        return false;
+    }
+    if (options.pyramidLevels < 0 || options.pyramidLevels > 3) {
+        std::cerr << "The pyramid levels must be between 0 and 3." << std::endl;
+        return false;
+    }
+    marker::V4l2Capture::Format format;
+    if (!options.captureFormat.empty() && !marker::V4l2Capture::parseFormat(options.captureFormat, format)) {
+        std::cerr << "The capture format must be GREY or YUYV." << std::endl;
+        return false;
+    }
+    if (options.threads < 1 || options.tileThreads < 1) {
+        std::cerr << "At least one thread is needed." << std::endl;
+        return false;
+    }
+    return (!options.inputs.empty() || options.codecBenchmark > 0 || options.codecStress > 0) && options.repeat > 0;
+}
+
+void writeSeries(std::ostream& out, const std::string& name, LatencySeries& series, bool last) {
+    out << "    " << jsonString(name) << ": {"
+        << "\"count\": " << series.count()
+        << ", \"mean_us\": " << series.mean()
+        << ", \"p50_us\": " << series.percentile(50)
+        << ", \"p95_us\": " << series.percentile(95)
+        << ", \"p99_us\": " << series.percentile(99)
+        << ", \"max_us\": " << series.percentile(100)
+        << "}" << (last ? "" : ",") << std::endl;
+}
+
+} /* End of anonymous namespace */
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    marker::Scanner scanner;
+    marker::TraceWriter trace;
+    std::map<std::string, LatencySeries> stages;
+    std::vector<marker::GroundTruthMarker> truth;
+    Recall recall;
+    cv::Mat frame;
+    long frameCount = 0, markerCount = 0, validCodeCount = 0;
+    long seen = 0;
+    std::vector<marker::AdaptiveThreshold> kernelThresholders(KERNEL_COUNT);
+    std::vector<marker::Labeler> kernelLabelers(KERNEL_COUNT);
+    long allocationCount = 0, allocatingFrames = 0, growingFrames = 0, checkedMarkerFrames = 0;
+    // The largest frame, marker and component counts so far, warmup included.
+    long maxArea = 0, maxMarkers = 0, maxComponents = 0;
+    BatchBenchmark batch;
+    cv::Mat convertedFrame, convertedGrey;
+    CodecBenchmark codec;
+    long stressFailures = 0;
+    marker::FrameStoreWriter recorder;
+    Clock::time_point recordStart = Clock::now();
+    double detectionUs = 0.0;
+    bool done = false;
+
+    const marker::LabelKernels* kernels = marker::labelKernels(options.kernels.c_str());
+    if (kernels == NULL) {
+        std::cerr << "Kernels not supported: " << options.kernels << std::endl;
+        return 1;
+    }
+    scanner.setLabelKernels(kernels);
+    scanner.openingSize = options.openingSize;
+    scanner.tracking = options.tracking > 0;
+    scanner.fullScanInterval = options.tracking;
+    scanner.pyramidLevels = options.pyramidLevels;
+    scanner.threads = options.tileThreads;
+    if (!options.trace.empty()) {
+        if (!trace.open(options.trace)) {
+            std::cerr << "Cannot write trace: " << options.trace << std::endl;
+            return 1;
+        }
+        scanner.stats.trace = &trace;
+    }
+
+    for (int pass = 0; pass < options.repeat && !done; pass++) {
+        for (size_t i = 0; i < options.inputs.size() && !done; i++) {
+            FrameSource source(options.inputs[i], options);
+            if (!source.isOpened()) {
+                std::cerr << "Cannot open input: " << source.path << std::endl;
+                return 1;
+            }
+            while (!done) {
+                Clock::time_point t0 = Clock::now();
+                if (!source.read(frame)) {
+                    break;
+                }
+                if (seen == options.warmup) {
+                    // Only count the measured frames.
+                    scanner.stats.reset();
+                }
+                Clock::time_point t1 = Clock::now();
+                long allocationsBefore = countedAllocations();
+                const std::vector<marker::Marker>& markers = frame.type() == CV_8UC1
+                    ? scanner.findMarkers(frame.ptr(), frame.cols, frame.rows, frame.step, options.windowSize, options.C)
+                    : scanner.findMarkers(frame, options.windowSize, options.C);
+                long allocations = countedAllocations() - allocationsBefore;
+                Clock::time_point t2 = Clock::now();
+                long area = (long)frame.cols * frame.rows;
+                long components = scanner.stats.last[marker::COUNTER_COMPONENTS];
+                bool growing = area > maxArea || (long)markers.size() > maxMarkers || components > maxComponents;
+                if (growing) {
+                    maxArea = area > maxArea ? area : maxArea;
+                    maxMarkers = (long)markers.size() > maxMarkers ? (long)markers.size() : maxMarkers;
+                    maxComponents = components > maxComponents ? components : maxComponents;
+                }
+
+                if (seen++ >= options.warmup) {
+                    stages["read"].add(elapsedMicroseconds(t0, t1));
+                    stages["findMarkers"].add(elapsedMicroseconds(t1, t2));
+#ifndef DISABLE_TRACING
+                    for (int stage = marker::STAGE_FRAME + 1; stage < marker::STAGE_COUNT; stage++) {
+                        stages[std::string("scanner.") + marker::stageName(stage)].add(scanner.stats.lastUs[stage]);
+                    }
+#endif
+                    detectionUs += elapsedMicroseconds(t1, t2);
+                    frameCount++;
+                    markerCount += markers.size();
+                    for (size_t m = 0; m < markers.size(); m++) {
+                        if (markers[m].hasValidCode) {
+                            validCodeCount++;
+                        }
+                    }
+                    if (!source.currentFile.empty()
+                     && marker::readGroundTruth(marker::groundTruthPath(source.currentFile), truth)) {
+                        matchGroundTruth(truth, markers, recall);
+                    }
+                    if (options.compareKernels) {
+                        compareKernels(frame, scanner.greyImage, scanner.binaryImage, options, kernelThresholders,
+                                       kernelLabelers, stages);
+                    }
+                    if (!options.captureFormat.empty()) {
+                        stages["ingest.avoidedConversion"].add(conversionMicroseconds(frame, convertedFrame, convertedGrey));
+                    }
+                    if (options.checkAllocations) {
+                        allocationCount += allocations;
+                        allocatingFrames += allocations > 0 && !growing ? 1 : 0;
+                        growingFrames += allocations > 0 && growing ? 1 : 0;
+                        checkedMarkerFrames += markers.empty() ? 0 : 1;
+                    }
+                    done = options.maxFrames > 0 && frameCount >= options.maxFrames;
+                }
+                if (!options.record.empty()) {
+                    if (!recorder.isOpened() && !recorder.open(options.record, frame.size(), frame.type())) {
+                        std::cerr << recorder.error() << std::endl;
+                        return 1;
+                    }
+                    if (!recorder.write(frame, (int64_t)elapsedMicroseconds(recordStart, t0))) {
+                        std::cerr << "Cannot record " << source.path << ": " << recorder.error() << std::endl;
+                        return 1;
+                    }
+                }
+            }
+            // The frame may be a view of the source, about to be closed.
+            frame.release();
+        }
+    }
+    if (recorder.isOpened() && !recorder.close()) {
+        std::cerr << recorder.error() << std::endl;
+        return 1;
+    }
+
+    if (options.batchThreads > 0) {
+        batch = benchmarkBatch(options, kernels);
+    }
+    if (options.codecBenchmark > 0) {
+        codec = benchmarkCodec(options.codecBenchmark);
+    }
+    if (options.codecStress > 0) {
+        stressFailures = stressCodec(options.threads, options.codecStress);
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output.c_str());
+        if (!file) {
+            std::cerr << "Cannot write report: " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = options.output.empty() ? std::cout : file;
+    double seconds = detectionUs / 1e6;
+
+    out << "{" << std::endl;
+    out << "  \"config\": {\"windowSize\": " << options.windowSize
+        << ", \"C\": " << options.C
+        << ", \"repeat\": " << options.repeat
+        << ", \"warmup\": " << options.warmup
+        << ", \"openingSize\": " << options.openingSize
+        << ", \"tracking\": " << options.tracking
+        << ", \"pyramidLevels\": " << options.pyramidLevels
+        << ", \"checkAllocations\": " << (options.checkAllocations ? "true" : "false")
+        << ", \"tileThreads\": " << options.tileThreads
+        << ", \"batchThreads\": " << options.batchThreads
+        << ", \"capture\": " << jsonString(options.captureFormat)
+        << ", \"grey\": " << (options.grey ? "true" : "false")
+        << ", \"record\": " << jsonString(options.record)
+        << ", \"kernels\": " << jsonString(kernels->name) << "}," << std::endl;
+    out << "  \"inputs\": [";
+    for (size_t i = 0; i < options.inputs.size(); i++) {
+        out << (i ? ", " : "") << jsonString(options.inputs[i]);
+    }
+    out << "]," << std::endl;
+    out << "  \"frames\": " << frameCount << "," << std::endl;
+    out << "  \"markers\": " << markerCount << "," << std::endl;
+    out << "  \"validCodes\": " << validCodeCount << "," << std::endl;
+    out << "  \"detectionSeconds\": " << seconds << "," << std::endl;
+    out << "  \"framesPerSecond\": " << (seconds > 0 ? frameCount / seconds : 0.0) << "," << std::endl;
+    out << "  \"markersPerSecond\": " << (seconds > 0 ? markerCount / seconds : 0.0) << "," << std::endl;
+    if (recall.truth > 0) {
+        out << "  \"groundTruth\": {\"markers\": " << recall.truth
+            << ", \"detected\": " << recall.detected
+            << ", \"decoded\": " << recall.decoded
+            << ", \"recall\": " << (double)recall.detected / recall.truth
+            << ", \"decodeRate\": " << (double)recall.decoded / recall.truth << "}," << std::endl;
+    }
+    if (options.checkAllocations) {
+        out << "  \"allocationCheck\": {\"frames\": " << frameCount
+            << ", \"allocations\": " << allocationCount
+            << ", \"framesWithMarkers\": " << checkedMarkerFrames
+            << ", \"framesGrowingBuffers\": " << growingFrames
+            << ", \"framesWithAllocations\": " << allocatingFrames << "}," << std::endl;
+    }
+    if (!options.captureFormat.empty()) {
+        // The dequeue is the "read" stage, the conversions are not done but measured.
+        double avoided = stages["ingest.avoidedConversion"].mean();
+        out << "  \"ingest\": {\"format\": " << jsonString(options.captureFormat)
+            << ", \"dequeueUs\": " << stages["read"].mean()
+            << ", \"avoidedConversionUs\": " << avoided
+            << ", \"savedUsPerFrame\": " << avoided << "}," << std::endl;
+    }
+    if (options.batchThreads > 0) {
+        out << "  \"batch\": {\"threads\": " << options.batchThreads
+            << ", \"frames\": " << batch.frames
+            << ", \"markers\": " << batch.markers
+            << ", \"validCodes\": " << batch.validCodes
+            << ", \"seconds\": " << batch.seconds
+            << ", \"framesPerSecond\": " << (batch.seconds > 0 ? batch.frames / batch.seconds : 0.0) << "}," << std::endl;
+    }
+    if (options.codecBenchmark > 0) {
+        out << "  \"codecBenchmark\": {\"codewords\": " << options.codecBenchmark
+            << ", \"referenceNsPerCodeword\": " << codec.referenceNs
+            << ", \"codecNsPerCodeword\": " << codec.codecNs
+            << ", \"mismatches\": " << codec.mismatches << "}," << std::endl;
+    }
+    if (options.codecStress > 0) {
+        out << "  \"codecStress\": {\"threads\": " << options.threads
+            << ", \"codewords\": " << (long)options.threads * options.codecStress
+            << ", \"failures\": " << stressFailures << "}," << std::endl;
+    }
+    out << "  \"counters\": {";
+    for (int counter = 0; counter < marker::COUNTER_COUNT; counter++) {
+        out << (counter ? ", " : "") << jsonString(marker::counterName(counter)) << ": " << scanner.stats.total[counter];
+    }
+    out << "}," << std::endl;
+    out << "  \"stages\": {" << std::endl;
+    size_t index = 0;
+    for (std::map<std::string, LatencySeries>::iterator it = stages.begin(); it != stages.end(); ++it) {
+        writeSeries(out, it->first, it->second, ++index == stages.size());
+    }
+    out << "  }" << std::endl;
+    out << "}" << std::endl;
+    return (frameCount > 0 || options.inputs.empty()) && allocatingFrames == 0 && codec.mismatches == 0
+        && stressFailures == 0 ? 0 : 1;
+}
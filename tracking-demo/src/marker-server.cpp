@@ -0,0 +1,474 @@
+/*
+ * Headless detection server for several cameras at once.
+ *
+ * Each source (camera index, video file or image sequence pattern) gets a capture thread
+ * and a detection thread with its own Scanner, the main thread writes the results. The
+ * stages are connected by bounded lock-free queues: when detection falls behind, the
+ * frames waiting for it are dropped so that the latency stays bounded, and the
+ * throughput of each stream is reported periodically and as JSON at the end.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include <opencv2/videoio.hpp>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "marker.h"
+#include "spsc.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    int windowSize;
+    int C;
+    int openingSize;
+    int tracking; // Full scan interval, 0 when not tracking
+    int pyramidLevels;
+    int queueSize;
+    bool block;
+    int maxFrames;
+    double reportInterval;
+    std::string output;
+    std::vector<std::string> sources;
+
+    Options() : windowSize(25), C(10), openingSize(1), tracking(0), pyramidLevels(0), queueSize(2), block(false),
+                maxFrames(0), reportInterval(1.0) {}
+};
+
+struct Frame {
+    long index;
+    Clock::time_point captured;
+    cv::Mat image;
+
+    Frame() : index(-1) {}
+};
+
+struct Detection {
+    cv::Point2f center;
+    bool valid;
+    uint8_t code[4];
+};
+
+struct Result {
+    long index;
+    Clock::time_point captured;
+    Clock::time_point detected;
+    std::vector<Detection> markers;
+
+    Result() : index(-1) {}
+};
+
+std::atomic<bool> stopRequested(false);
+
+void requestStop(int) {
+    stopRequested.store(true);
+}
+
+double elapsedMilliseconds(Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() / 1000.0;
+}
+
+/* The three stages of one source. The counters are written by a single stage each and
+ * read by the reporting in the main thread. */
+class Stream {
+public:
+    Stream(const std::string& source, const Options& options)
+        : source(source), options(options), frames(options.queueSize), results(options.queueSize * 2),
+          captured(0), dropped(0), skipped(0), detected(0), resultsDropped(0),
+          captureDone(false), detectDone(false), processed(0), decoded(0),
+          latencySum(0.0), latencyMax(0.0), reportedCaptured(0), reportedProcessed(0) {
+        scanner.openingSize = options.openingSize;
+        scanner.tracking = options.tracking > 0;
+        scanner.fullScanInterval = options.tracking;
+        scanner.pyramidLevels = options.pyramidLevels;
+    }
+
+    bool open() {
+        char* end = NULL;
+        long device = strtol(source.c_str(), &end, 10);
+        if (!source.empty() && *end == '\0') {
+            capture.open((int)device);
+        } else {
+            capture.open(source);
+        }
+        return capture.isOpened();
+    }
+
+    void start() {
+        started = Clock::now();
+        captureThread = std::thread(&Stream::captureLoop, this);
+        detectThread = std::thread(&Stream::detectLoop, this);
+    }
+
+    void join() {
+        captureThread.join();
+        detectThread.join();
+    }
+
+    /* Output stage, in the main thread: returns false when there is no result ready. */
+    bool pollResult(Result& result) {
+        if (!results.pop(result)) {
+            return false;
+        }
+        double latency = elapsedMilliseconds(result.captured, result.detected);
+        latencySum += latency;
+        latencyMax = latency > latencyMax ? latency : latencyMax;
+        processed++;
+        for (size_t i = 0; i < result.markers.size(); i++) {
+            if (result.markers[i].valid) {
+                decoded++;
+            }
+        }
+        return true;
+    }
+
+    /* Done once the last result has been taken by the output stage. */
+    bool finished() const {
+        return detectDone.load(std::memory_order_acquire) && results.size() == 0;
+    }
+
+    std::string source;
+    const Options& options;
+    marker::SpscQueue<Frame> frames;
+    marker::SpscQueue<Result> results;
+    marker::Scanner scanner;
+
+    /* Written by the capture stage. */
+    std::atomic<long> captured;
+    std::atomic<long> dropped;        // Queue full, the new frame was not queued
+    /* Written by the detection stage. */
+    std::atomic<long> skipped;        // Stale frames replaced by a newer one in the queue
+    std::atomic<long> detected;
+    std::atomic<long> resultsDropped; // The output stage did not keep up
+    std::atomic<bool> captureDone;
+    std::atomic<bool> detectDone;
+    /* Written by the output stage. */
+    long processed;
+    long decoded;
+    double latencySum; // Capture to end of detection, in milliseconds
+    double latencyMax;
+    long reportedCaptured;
+    long reportedProcessed;
+    Clock::time_point started;
+    Clock::time_point stopped;
+
+private:
+    void captureLoop() {
+        long index = 0;
+        while (!stopRequested.load() && (options.maxFrames == 0 || index < options.maxFrames)) {
+            // A new frame each time: the previous one may still be queued or in use.
+            Frame frame;
+            if (!capture.read(frame.image) || frame.image.empty()) {
+                break;
+            }
+            frame.index = index++;
+            frame.captured = Clock::now();
+            captured.fetch_add(1, std::memory_order_relaxed);
+            while (!frames.push(frame)) {
+                if (!options.block || stopRequested.load()) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+        captureDone.store(true, std::memory_order_release);
+    }
+
+    void detectLoop() {
+        Frame frame;
+        for (;;) {
+            if (!frames.pop(frame)) {
+                // The frames pushed before captureDone was set are visible after reading it.
+                if (captureDone.load(std::memory_order_acquire)) {
+                    if (!frames.pop(frame)) {
+                        break;
+                    }
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    continue;
+                }
+            }
+            // Only the newest frame is worth detecting, the older ones are stale.
+            if (!options.block) {
+                Frame newer;
+                while (frames.pop(newer)) {
+                    frame = newer;
+                    skipped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            const std::vector<marker::Marker>& markers = scanner.findMarkers(frame.image, options.windowSize, options.C);
+            Result result;
+            result.index = frame.index;
+            result.captured = frame.captured;
+            result.detected = Clock::now();
+            result.markers.resize(markers.size());
+            for (size_t i = 0; i < markers.size(); i++) {
+                Detection& detection = result.markers[i];
+                detection.center = markers[i].center;
+                detection.valid = markers[i].hasValidCode;
+                for (int b = 0; b < 4; b++) {
+                    detection.code[b] = markers[i].codeValue[b];
+                }
+            }
+            frame = Frame();
+            detected.fetch_add(1, std::memory_order_relaxed);
+            while (!results.push(result)) {
+                if (!options.block) {
+                    resultsDropped.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        }
+        stopped = Clock::now();
+        detectDone.store(true, std::memory_order_release);
+    }
+
+    cv::VideoCapture capture;
+    std::thread captureThread;
+    std::thread detectThread;
+};
+
+void writeResult(std::ostream& out, size_t stream, const Result& result) {
+    char code[16];
+    out << "{\"stream\": " << stream << ", \"frame\": " << result.index
+        << ", \"latencyMs\": " << elapsedMilliseconds(result.captured, result.detected) << ", \"markers\": [";
+    for (size_t i = 0; i < result.markers.size(); i++) {
+        const Detection& detection = result.markers[i];
+        snprintf(code, sizeof(code), "%02x%02x%02x%02x",
+                 detection.code[0], detection.code[1], detection.code[2], detection.code[3]);
+        out << (i ? ", " : "") << "{\"x\": " << detection.center.x << ", \"y\": " << detection.center.y;
+        if (detection.valid) {
+            out << ", \"code\": \"" << code << "\"";
+        }
+        out << "}";
+    }
+    out << "]}" << std::endl;
+}
+
+/* One line per stream on stderr, the rates are over the last interval. */
+void report(std::vector<Stream*>& streams, double seconds) {
+    for (size_t i = 0; i < streams.size(); i++) {
+        Stream& stream = *streams[i];
+        long captured = stream.captured.load(std::memory_order_relaxed);
+        fprintf(stderr, "stream %zu: capture %.1f fps, detect %.1f fps, dropped %ld, skipped %ld, latency %.1f ms mean %.1f ms max\n",
+                i, (captured - stream.reportedCaptured) / seconds, (stream.processed - stream.reportedProcessed) / seconds,
+                stream.dropped.load(std::memory_order_relaxed), stream.skipped.load(std::memory_order_relaxed),
+                stream.processed ? stream.latencySum / stream.processed : 0.0, stream.latencyMax);
+        stream.reportedCaptured = captured;
+        stream.reportedProcessed = stream.processed;
+    }
+}
+
+std::string jsonString(const std::string& s) {
+    std::string escaped = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            escaped += buffer;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped + "\"";
+}
+
+void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [options] <camera-index|video|image-pattern>..." << std::endl
+              << "  --window N      adaptive threshold window size (default 25)" << std::endl
+              << "  --C N           adaptive threshold constant (default 10)" << std::endl
+              << "  --opening N     size of the opening of the binary image, 0 to skip it (default 1)" << std::endl
+              << "  --tracking N    only scan around the markers of the previous frame, full scan every N frames" << std::endl
+              << "  --pyramid N     detect on the frame downsampled N times by 2, read at full resolution" << std::endl
+              << "  --queue N       frames waiting for detection per stream (default 2)" << std::endl
+              << "  --block         wait for the detection instead of dropping frames (files)" << std::endl
+              << "  --max-frames N  stop each stream after N captured frames (default: no limit)" << std::endl
+              << "  --report S      seconds between the throughput reports on stderr, 0 for none (default 1)" << std::endl
+              << "  --output FILE   write the markers of each frame as JSON lines, - for stdout (the summary goes to stderr)" << std::endl;
+}
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--window" && hasValue) {
+            options.windowSize = atoi(argv[++i]);
+        } else if (arg == "--C" && hasValue) {
+            options.C = atoi(argv[++i]);
+        } else if (arg == "--opening" && hasValue) {
+            options.openingSize = atoi(argv[++i]);
+        } else if (arg == "--tracking" && hasValue) {
+            options.tracking = atoi(argv[++i]);
+        } else if (arg == "--pyramid" && hasValue) {
+            options.pyramidLevels = atoi(argv[++i]);
+        } else if (arg == "--queue" && hasValue) {
+            options.queueSize = atoi(argv[++i]);
+        } else if (arg == "--block") {
+            options.block = true;
+        } else if (arg == "--max-frames" && hasValue) {
+            options.maxFrames = atoi(argv[++i]);
+        } else if (arg == "--report" && hasValue) {
+            options.reportInterval = atof(argv[++i]);
+        } else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        } else {
+            options.sources.push_back(arg);
+        }
+    }
+    if (options.windowSize < 3 || (options.windowSize % 2) == 0) {
+        std::cerr << "The window size must be odd and at least 3." << std::endl;
+        return false;
+    }
+    if (options.openingSize < 0 || options.openingSize > 127) {
+        std::cerr << "The opening size must be between 0 and 127." << std::endl;
+        return false;
+    }
+    if (options.pyramidLevels < 0 || options.pyramidLevels > 3) {
+        std::cerr << "The pyramid levels must be between 0 and 3." << std::endl;
+        return false;
+    }
+    if (options.queueSize < 1) {
+        std::cerr << "The queue size must be at least 1." << std::endl;
+        return false;
+    }
+    return !options.sources.empty();
+}
+
+} /* End of anonymous namespace */
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::ofstream file;
+    if (!options.output.empty() && options.output != "-") {
+        file.open(options.output.c_str());
+        if (!file) {
+            std::cerr << "Cannot write results: " << options.output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream* out = options.output.empty() ? NULL : options.output == "-" ? &std::cout : &file;
+
+    std::vector<Stream*> streams;
+    for (size_t i = 0; i < options.sources.size(); i++) {
+        streams.push_back(new Stream(options.sources[i], options));
+        if (!streams.back()->open()) {
+            std::cerr << "Cannot open source: " << options.sources[i] << std::endl;
+            for (size_t j = 0; j < streams.size(); j++) {
+                delete streams[j];
+            }
+            return 1;
+        }
+    }
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    for (size_t i = 0; i < streams.size(); i++) {
+        streams[i]->start();
+    }
+
+    // Output stage: the results of all the streams, in the main thread.
+    Clock::time_point lastReport = Clock::now();
+    Result result;
+    for (;;) {
+        bool idle = true;
+        bool finished = true;
+        for (size_t i = 0; i < streams.size(); i++) {
+            // Check before polling: a stream is only done once its queue is seen empty.
+            bool done = streams[i]->finished();
+            while (streams[i]->pollResult(result)) {
+                if (out) {
+                    writeResult(*out, i, result);
+                }
+                idle = false;
+                done = false;
+            }
+            finished = finished && done;
+        }
+        if (finished) {
+            break;
+        }
+        Clock::time_point now = Clock::now();
+        double seconds = elapsedMilliseconds(lastReport, now) / 1000.0;
+        if (options.reportInterval > 0 && seconds >= options.reportInterval) {
+            report(streams, seconds);
+            lastReport = now;
+        }
+        if (idle) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    // With the results on stdout, the summary goes to stderr: stdout stays JSON lines.
+    std::ostream& summary = options.output == "-" ? std::cerr : std::cout;
+    summary << "{" << std::endl;
+    summary << "  \"config\": {\"windowSize\": " << options.windowSize
+            << ", \"C\": " << options.C
+            << ", \"openingSize\": " << options.openingSize
+            << ", \"tracking\": " << options.tracking
+            << ", \"pyramidLevels\": " << options.pyramidLevels
+            << ", \"queueSize\": " << options.queueSize
+            << ", \"block\": " << (options.block ? "true" : "false") << "}," << std::endl;
+    summary << "  \"streams\": [" << std::endl;
+    for (size_t i = 0; i < streams.size(); i++) {
+        Stream& stream = *streams[i];
+        stream.join();
+        double seconds = elapsedMilliseconds(stream.started, stream.stopped) / 1000.0;
+        summary << "    {\"source\": " << jsonString(stream.source)
+                << ", \"captured\": " << stream.captured.load()
+                << ", \"dropped\": " << stream.dropped.load()
+                << ", \"skipped\": " << stream.skipped.load()
+                << ", \"detected\": " << stream.detected.load()
+                << ", \"resultsDropped\": " << stream.resultsDropped.load()
+                << ", \"validCodes\": " << stream.decoded
+                << ", \"seconds\": " << seconds
+                << ", \"framesPerSecond\": " << (seconds > 0 ? stream.detected.load() / seconds : 0.0)
+                << ", \"meanLatencyMs\": " << (stream.processed ? stream.latencySum / stream.processed : 0.0)
+                << ", \"maxLatencyMs\": " << stream.latencyMax
+                << "}" << (i + 1 < streams.size() ? "," : "") << std::endl;
+    }
+    summary << "  ]" << std::endl;
+    summary << "}" << std::endl;
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        delete streams[i];
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Generate a deterministic corpus of synthetic scenes with coded markers, and
+ * the ground truth for each of them.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include <opencv2/imgcodecs.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "framestore.h"
+#include "synth.h"
+
+using namespace marker;
+
+namespace {
+
+void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [options] <output-dir>" << std::endl
+              << "  --count N        number of scenes (default 100)" << std::endl
+              << "  --size WxH       image size, from 640x480 up to 3840x2160 (default 1920x1080)" << std::endl
+              << "  --markers N      markers per scene (default 4)" << std::endl
+              << "  --side MIN:MAX   distance between the corner dots in pixels (default 60:300)" << std::endl
+              << "  --tilt DEG       maximum out of plane rotation (default 40)" << std::endl
+              << "  --blur SIGMA     maximum gaussian blur (default 1.0)" << std::endl
+              << "  --noise SIGMA    sensor noise in grey levels (default 4)" << std::endl
+              << "  --gradient G     lighting fall-off across the image, 0 to 1 (default 0.3)" << std::endl
+              << "  --clutter N      background shapes per scene (default 40)" << std::endl
+              << "  --stroke S       marker stroke size as in mkPattern.py (default 72)" << std::endl
+              << "  --code A.B.C.D   use this code for every marker (default: random codes)" << std::endl
+              << "  --seed S         seed of the corpus (default 1)" << std::endl
+              << "  --store FILE     also write the scenes to FILE, a frame store for marker-bench" << std::endl;
+}
+
+bool parseOptions(int argc, char* argv[], SceneOptions& options, int& count, std::string& directory,
+                  std::string& store) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--count" && hasValue) {
+            count = atoi(argv[++i]);
+        } else if (arg == "--size" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.imageSize.width, &options.imageSize.height) != 2) {
+                return false;
+            }
+        } else if (arg == "--markers" && hasValue) {
+            options.markerCount = atoi(argv[++i]);
+        } else if (arg == "--side" && hasValue) {
+            if (sscanf(argv[++i], "%lf:%lf", &options.minSide, &options.maxSide) != 2) {
+                return false;
+            }
+        } else if (arg == "--tilt" && hasValue) {
+            options.maxTilt = atof(argv[++i]);
+        } else if (arg == "--blur" && hasValue) {
+            options.maxBlur = atof(argv[++i]);
+        } else if (arg == "--noise" && hasValue) {
+            options.noise = atof(argv[++i]);
+        } else if (arg == "--gradient" && hasValue) {
+            options.gradient = atof(argv[++i]);
+        } else if (arg == "--clutter" && hasValue) {
+            options.clutter = atoi(argv[++i]);
+        } else if (arg == "--stroke" && hasValue) {
+            options.stroke = atoi(argv[++i]);
+        } else if (arg == "--code" && hasValue) {
+            unsigned code[4];
+            if (sscanf(argv[++i], "%u.%u.%u.%u", &code[0], &code[1], &code[2], &code[3]) != 4) {
+                return false;
+            }
+            for (int b = 0; b < 4; b++) {
+                options.code[b] = (uint8_t)code[b];
+            }
+            options.fixedCode = true;
+        } else if (arg == "--seed" && hasValue) {
+            options.seed = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--store" && hasValue) {
+            store = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            directory = arg;
+        }
+    }
+    return !directory.empty() && count > 0 && options.imageSize.width >= 64 && options.imageSize.height >= 64
+        && options.minSide > 0 && options.minSide <= options.maxSide;
+}
+
+} /* End of anonymous namespace */
+
+int main(int argc, char* argv[]) {
+    SceneOptions options;
+    std::string directory;
+    std::string storePath;
+    int count = 100;
+
+    if (!parseOptions(argc, argv, options, count, directory, storePath)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    SceneGenerator generator(options);
+    std::vector<GroundTruthMarker> truth;
+    cv::Mat image;
+    long markerCount = 0;
+    FrameStoreWriter store;
+
+    // The store holds the same scenes as the images, the ground truth stays with the images.
+    if (!storePath.empty() && !store.open(storePath, options.imageSize, CV_8UC3)) {
+        std::cerr << store.error() << std::endl;
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/scene-%05d.png", i);
+        std::string path = directory + name;
+
+        generator.generate(i, image, truth);
+        if (!cv::imwrite(path, image) || !writeGroundTruth(groundTruthPath(path), image.size(), truth)) {
+            std::cerr << "Cannot write " << path << std::endl;
+            return 1;
+        }
+        // Timestamped as a 30 fps session.
+        if (store.isOpened() && !store.write(image, i * 1000000LL / 30)) {
+            std::cerr << store.error() << std::endl;
+            return 1;
+        }
+        markerCount += truth.size();
+    }
+    if (store.isOpened() && !store.close()) {
+        std::cerr << store.error() << std::endl;
+        return 1;
+    }
+    std::cout << "Generated " << count << " scenes with " << markerCount << " markers in " << directory << std::endl;
+    return 0;
+}
@@ -0,0 +1,498 @@
+/*
+ * Equivalence tests of the scanner: each optimized stage against the OpenCV function or
+ * the simpler code it replaces, on generated scenes. Run by ctest, or by hand with the
+ * names of the tests to run.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include <opencv2/imgproc.hpp>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "batch.h"
+#include "marker.h"
+#include "synth.h"
+
+namespace {
+
+/* Heap allocations of the process, for the allocations test. */
+std::atomic<long> allocationCounter(0);
+
+} /* End of anonymous namespace */
+
+void* operator new(std::size_t size) {
+    allocationCounter.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+namespace {
+
+const int WINDOW_SIZE = 25;
+const int C = 10;
+
+/* The scenes all the tests run on, rendered once. */
+const std::vector<cv::Mat>& scenes() {
+    static std::vector<cv::Mat> images;
+    if (images.empty()) {
+        marker::SceneOptions options;
+        options.imageSize = cv::Size(960, 540);
+        options.maxSide = 200;
+        options.seed = 7;
+        marker::SceneGenerator generator(options);
+        std::vector<marker::GroundTruthMarker> truth;
+        for (int i = 0; i < 6; i++) {
+            cv::Mat image;
+            generator.generate(i, image, truth);
+            images.push_back(image);
+        }
+    }
+    return images;
+}
+
+cv::Mat greyScene(int i) {
+    cv::Mat grey;
+    cv::cvtColor(scenes()[i], grey, CV_BGR2GRAY);
+    return grey;
+}
+
+/* A YUYV frame with the given luma, and chroma bytes that must be ignored. */
+cv::Mat yuyvFrame(const cv::Mat& grey, std::mt19937& generator) {
+    cv::Mat yuyv(grey.rows, grey.cols, CV_8UC2);
+    for (int y = 0; y < grey.rows; y++) {
+        for (int x = 0; x < grey.cols; x++) {
+            yuyv.ptr<uchar>(y)[2 * x] = grey.ptr<uchar>(y)[x];
+            yuyv.ptr<uchar>(y)[2 * x + 1] = (uchar)generator();
+        }
+    }
+    return yuyv;
+}
+
+bool sameMat(const cv::Mat& a, const cv::Mat& b) {
+    if (a.size() != b.size() || a.type() != b.type()) {
+        return false;
+    }
+    for (int y = 0; y < a.rows; y++) {
+        if (memcmp(a.ptr(y), b.ptr(y), a.cols * a.elemSize()) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Are the two lists of markers the same, to the last bit? */
+bool sameMarkers(const std::vector<marker::Marker>& markers, const std::vector<marker::Marker>& expected) {
+    if (expected.size() != markers.size()) {
+        return false;
+    }
+    for (size_t m = 0; m < markers.size(); m++) {
+        const marker::Marker& a = markers[m];
+        const marker::Marker& b = expected[m];
+        if (memcmp(&a.center, &b.center, sizeof(a.center)) != 0
+         || memcmp(&a.zero, &b.zero, sizeof(a.zero)) != 0
+         || memcmp(&a.one, &b.one, sizeof(a.one)) != 0
+         || memcmp(a.two, b.two, sizeof(a.two)) != 0
+         || memcmp(a.three, b.three, sizeof(a.three)) != 0
+         || memcmp(a.codeCorners, b.codeCorners, sizeof(a.codeCorners)) != 0
+         || memcmp(a.codeword, b.codeword, sizeof(a.codeword)) != 0
+         || a.hasValidCode != b.hasValidCode
+         || (a.hasValidCode && memcmp(a.codeValue, b.codeValue, sizeof(a.codeValue)) != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The single pass labeling must give the same components as OpenCV labeling the white
+ * and the black pixels separately, only the numbering differs. The parents are checked
+ * against the label image. */
+bool sameLabels(const cv::Mat& binary, marker::Labeler& labeler) {
+    cv::Mat labels, stats, centroids;
+    cv::Mat colours[2], reference[2], referenceStats[2], referenceCentroids[2];
+    std::vector<int> parents;
+    int count = labeler.label(binary, stats, centroids, parents);
+    labeler.draw(labels);
+    cv::compare(binary, 0, colours[0], cv::CMP_NE);
+    cv::compare(binary, 0, colours[1], cv::CMP_EQ);
+    int referenceCount[2];
+    for (int c = 0; c < 2; c++) {
+        referenceCount[c] = cv::connectedComponentsWithStats(colours[c], reference[c], referenceStats[c],
+                                                             referenceCentroids[c], 4, CV_32S);
+    }
+    if (count - 1 != referenceCount[0] - 1 + referenceCount[1] - 1) {
+        return false;
+    }
+    // With the same number of components, a consistent mapping is a bijection.
+    std::vector<std::pair<int, int> > mapping(count, std::make_pair(-1, -1));
+    for (int y = 0; y < binary.rows; y++) {
+        for (int x = 0; x < binary.cols; x++) {
+            int c = binary.at<uchar>(y, x) ? 0 : 1;
+            std::pair<int, int> other(c, reference[c].at<int>(y, x));
+            std::pair<int, int>& mapped = mapping[labels.at<int>(y, x)];
+            if (mapped.first < 0) {
+                // First pixel of the component, its parent is on the left.
+                if (parents[labels.at<int>(y, x)] != (x > 0 ? labels.at<int>(y, x - 1) : 0)) {
+                    return false;
+                }
+                mapped = other;
+            } else if (mapped != other) {
+                return false;
+            }
+        }
+    }
+    for (int label = 1; label < count; label++) {
+        int c = mapping[label].first, other = mapping[label].second;
+        for (int i = 0; i < cv::CC_STAT_MAX; i++) {
+            if (stats.at<int>(label, i) != referenceStats[c].at<int>(other, i)) {
+                return false;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fabs(centroids.at<double>(label, i) - referenceCentroids[c].at<double>(other, i)) > 1e-6) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* The binary images of the scenes, then random noise of odd sizes. */
+bool testLabels() {
+    marker::AdaptiveThreshold thresholder;
+    marker::BinaryOpening opening;
+    marker::Labeler labeler;
+    cv::Mat grey, binary;
+    bool passed = true;
+    for (size_t i = 0; i < scenes().size(); i++) {
+        thresholder.apply(scenes()[i], grey, binary, WINDOW_SIZE, C);
+        opening.apply(binary, 1);
+        passed = passed && sameLabels(binary, labeler);
+    }
+    std::mt19937 generator(1);
+    for (int i = 0; i < 20; i++) {
+        cv::Mat noise(1 + generator() % 100, 1 + generator() % 200, CV_8UC1);
+        for (int y = 0; y < noise.rows; y++) {
+            for (int x = 0; x < noise.cols; x++) {
+                noise.at<uchar>(y, x) = generator() % 3 == 0 ? 1 : 0;
+            }
+        }
+        passed = passed && sameLabels(noise, labeler);
+    }
+    return passed;
+}
+
+/* The fused threshold against cv::cvtColor and cv::adaptiveThreshold, for BGR, grey and
+ * YUYV frames. */
+bool testThreshold() {
+    const int windows[] = { 3, 11, 25, 51 };
+    const int constants[] = { -5, 0, 10 };
+    marker::AdaptiveThreshold thresholder;
+    std::mt19937 generator(2);
+    bool passed = true;
+    for (size_t i = 0; i < scenes().size(); i++) {
+        cv::Mat referenceGrey = greyScene((int)i);
+        cv::Mat frames[3] = { scenes()[i], referenceGrey, yuyvFrame(referenceGrey, generator) };
+        for (int f = 0; f < 3; f++) {
+            for (int w = 0; w < 4; w++) {
+                cv::Mat grey, binary, referenceBinary;
+                int windowSize = windows[w], constant = constants[(i + w) % 3];
+                thresholder.apply(frames[f], grey, binary, windowSize, constant);
+                cv::adaptiveThreshold(referenceGrey, referenceBinary, 1, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY,
+                                      windowSize, constant);
+                passed = passed && sameMat(grey, referenceGrey) && sameMat(binary, referenceBinary);
+            }
+        }
+    }
+    return passed;
+}
+
+/* The opening against cv::erode and cv::dilate. */
+bool testOpening() {
+    marker::AdaptiveThreshold thresholder;
+    marker::BinaryOpening opening;
+    bool passed = true;
+    for (size_t i = 0; i < scenes().size(); i++) {
+        for (int size = 0; size <= 3; size++) {
+            cv::Mat grey, binary, reference;
+            cv::Mat element = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(2 * size + 1, 2 * size + 1));
+            thresholder.apply(scenes()[i], grey, binary, WINDOW_SIZE, C);
+            cv::erode(binary, reference, element);
+            cv::dilate(reference, reference, element);
+            opening.apply(binary, size);
+            passed = passed && sameMat(binary, reference);
+        }
+    }
+    return passed;
+}
+
+/* The batch decoder against MarkerCodec decoding the codewords one by one, with the same
+ * second chance: on random codewords with up to 4 bytes wrong, then on the markers of
+ * the scenes. */
+bool testDecoder() {
+    const int L = marker::CODE_LENGTH, M = marker::CODE_MESSAGE_LENGTH;
+    const int count = 1000;
+    std::mt19937 generator(3);
+    std::vector<uint8_t> codewords(count * L), messages(count * M);
+    std::vector<marker::CodeStatus> status(count);
+    for (int c = 0; c < count; c++) {
+        uint8_t message[M];
+        for (int i = 0; i < M; i++) {
+            message[i] = (uint8_t)generator();
+        }
+        marker::MarkerCodec::encode(message, &codewords[c * L]);
+        for (int e = 0; e < c % 5; e++) {
+            codewords[c * L + generator() % L] ^= (uint8_t)(1 + generator() % 255);
+        }
+    }
+    marker::CodeDecoder decoder;
+    decoder.decode(&codewords[0], &messages[0], &status[0], count);
+    bool passed = true;
+    for (int c = 0; c < count; c++) {
+        uint8_t message[M];
+        marker::CodeStatus expected = marker::MarkerCodec::decode(&codewords[c * L], message);
+        passed = passed && status[c] == expected
+            && (expected == marker::CODE_INVALID || memcmp(message, &messages[c * M], M) == 0);
+    }
+
+    marker::Scanner scanner;
+    for (size_t i = 0; i < scenes().size(); i++) {
+        cv::Mat frame = scenes()[i];
+        const std::vector<marker::Marker>& markers = scanner.findMarkers(frame, WINDOW_SIZE, C);
+        for (size_t m = 0; m < markers.size(); m++) {
+            uint8_t message[M];
+            const marker::Marker& found = markers[m];
+            bool valid = marker::MarkerCodec::decode(found.codeword, message) != marker::CODE_INVALID
+                      || marker::decodeWithErasures(found.codeword, found.codeConfidence, message) != marker::CODE_INVALID;
+            passed = passed && valid == found.hasValidCode
+                && (!valid || memcmp(message, found.codeValue, M) == 0);
+        }
+    }
+    return passed;
+}
+
+/* The tiled scan finds the same markers as the serial scan, in full and pyramid mode. */
+bool testTiles() {
+    bool passed = true;
+    for (int levels = 0; levels <= 1; levels++) {
+        marker::Scanner tiled, serial;
+        tiled.threads = 4;
+        tiled.pyramidLevels = serial.pyramidLevels = levels;
+        for (size_t i = 0; i < scenes().size(); i++) {
+            cv::Mat frame = scenes()[i];
+            passed = passed && sameMarkers(tiled.findMarkers(frame, WINDOW_SIZE, C),
+                                           serial.findMarkers(frame, WINDOW_SIZE, C));
+        }
+    }
+    return passed;
+}
+
+/* The BatchScanner finds the same markers as a single Scanner, frame by frame. */
+bool testBatch() {
+    marker::BatchScanner batch(3);
+    marker::Scanner serial;
+    std::vector<std::vector<marker::Marker> > results;
+    batch.scan(scenes(), WINDOW_SIZE, C, results);
+    bool passed = results.size() == scenes().size();
+    for (size_t i = 0; passed && i < scenes().size(); i++) {
+        cv::Mat frame = scenes()[i];
+        passed = sameMarkers(results[i], serial.findMarkers(frame, WINDOW_SIZE, C));
+    }
+    return passed;
+}
+
+/* A grey frame given by pointer is only read: the BGR and YUYV frames of the same size
+ * scanned after it are converted into buffers of the scanner, serial and tiled. */
+bool testBorrowed() {
+    std::mt19937 generator(13);
+    bool passed = true;
+    for (int threads = 1; threads <= 4; threads += 3) {
+        marker::Scanner scanner;
+        scanner.threads = threads;
+        cv::Mat grey = greyScene(0);
+        cv::Mat original = grey.clone();
+        cv::Mat frames[2] = { scenes()[1], yuyvFrame(greyScene(2), generator) };
+        for (int i = 0; i < 2; i++) {
+            scanner.findMarkers(grey.data, grey.cols, grey.rows, grey.step, WINDOW_SIZE, C);
+            scanner.findMarkers(frames[i], WINDOW_SIZE, C);
+            passed = passed && sameMat(grey, original);
+        }
+    }
+    return passed;
+}
+
+/* The threshold and labeling kernels of each instruction set the CPU supports give the
+ * results of the scalar ones. */
+bool testKernels() {
+    const char* const names[] = { "sse2", "avx2", "avx512" };
+    const marker::LabelKernels* scalar = marker::labelKernels("scalar");
+    marker::AdaptiveThreshold thresholder, windowThresholder;
+    marker::Labeler reference, labeler;
+    thresholder.setKernels(marker::thresholdKernels("scalar"));
+    reference.setKernels(scalar);
+    bool passed = true;
+    for (size_t i = 0; i < scenes().size(); i++) {
+        cv::Mat grey, binary, stats[2], centroids[2];
+        std::vector<int> parents[2];
+        thresholder.apply(scenes()[i], grey, binary, WINDOW_SIZE, C);
+        reference.label(binary, stats[0], centroids[0], parents[0]);
+        cv::Mat fixed[2] = { cv::Mat(grey.size(), CV_8UC1), cv::Mat(grey.size(), CV_8UC1) };
+        for (int y = 0; y < grey.rows; y++) {
+            scalar->threshold(grey.ptr<uchar>(y), fixed[0].ptr<uchar>(y), grey.cols, 127);
+        }
+        for (int k = 0; k < 3; k++) {
+            const marker::ThresholdKernels* windowKernels = marker::thresholdKernels(names[k]);
+            if (windowKernels != NULL) {
+                // Odd windows and widths, for the tails of the rows.
+                for (int w = 3; w <= 51; w += 24) {
+                    cv::Mat windowGrey, windowBinary[2];
+                    cv::Mat image = scenes()[i].colRange(0, scenes()[i].cols - w / 3);
+                    thresholder.apply(image, windowGrey, windowBinary[0], w, C);
+                    windowThresholder.setKernels(windowKernels);
+                    windowThresholder.apply(image, windowGrey, windowBinary[1], w, C);
+                    passed = passed && sameMat(windowBinary[0], windowBinary[1]);
+                }
+            }
+            const marker::LabelKernels* kernels = marker::labelKernels(names[k]);
+            if (kernels == NULL) {
+                continue;
+            }
+            labeler.setKernels(kernels);
+            labeler.label(binary, stats[1], centroids[1], parents[1]);
+            for (int y = 0; y < grey.rows; y++) {
+                kernels->threshold(grey.ptr<uchar>(y), fixed[1].ptr<uchar>(y), grey.cols, 127);
+            }
+            passed = passed && sameMat(stats[0], stats[1]) && sameMat(centroids[0], centroids[1])
+                && parents[0] == parents[1] && sameMat(fixed[0], fixed[1]);
+        }
+    }
+    return passed;
+}
+
+/* The corners refined by the scanner against cv::cornerSubPix with the same settings,
+ * from the corners of the markers of the scenes moved by up to 2 pixels. */
+bool testCorners() {
+    marker::Scanner scanner;
+    marker::CornerRefiner refiner;
+    std::mt19937 generator(4);
+    std::uniform_real_distribution<float> offset(-2.0f, 2.0f);
+    bool passed = true;
+    int corners = 0;
+    for (size_t i = 0; i < scenes().size(); i++) {
+        cv::Mat frame = scenes()[i];
+        const std::vector<marker::Marker>& markers = scanner.findMarkers(frame, WINDOW_SIZE, C);
+        for (size_t m = 0; m < markers.size(); m++) {
+            cv::Point2f refined[4], reference[4];
+            for (int c = 0; c < 4; c++) {
+                refined[c] = reference[c] = markers[m].codeCorners[c] + cv::Point2f(offset(generator), offset(generator));
+            }
+            refiner.refine(scanner.greyImage, refined, 4, 5);
+            cv::Mat points(4, 1, CV_32FC2, reference);
+            cv::cornerSubPix(scanner.greyImage, points, cv::Size(5, 5), cv::Size(-1, -1),
+                             cv::TermCriteria(cv::TermCriteria::COUNT, 40, 0.001));
+            for (int c = 0; c < 4; c++, corners++) {
+                passed = passed && cv::norm(refined[c] - reference[c]) < 0.01;
+            }
+        }
+    }
+    return passed && corners > 0;
+}
+
+/* Once the buffers have grown to the size of the scenes, scanning them again does not
+ * allocate, in full, pyramid and tiled mode. The scenes have markers: the whole path,
+ * corner refinement and decoding included, is counted. */
+bool testAllocations() {
+    bool passed = true;
+    for (int mode = 0; mode < 3; mode++) {
+        marker::Scanner scanner;
+        scanner.pyramidLevels = mode == 1 ? 1 : 0;
+        scanner.threads = mode == 2 ? 4 : 1;
+        long markers = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t i = 0; i < scenes().size(); i++) {
+                cv::Mat frame = scenes()[i];
+                long before = allocationCounter.load();
+                markers += scanner.findMarkers(frame, WINDOW_SIZE, C).size();
+                passed = passed && (pass == 0 || allocationCounter.load() == before);
+            }
+        }
+        passed = passed && markers > 0;
+    }
+    return passed;
+}
+
+struct Test {
+    const char* name;
+    bool (*run)();
+};
+
+const Test TESTS[] = {
+    { "labels", testLabels },
+    { "threshold", testThreshold },
+    { "opening", testOpening },
+    { "decoder", testDecoder },
+    { "tiles", testTiles },
+    { "batch", testBatch },
+    { "borrowed", testBorrowed },
+    { "kernels", testKernels },
+    { "corners", testCorners },
+    { "allocations", testAllocations },
+};
+const int TEST_COUNT = sizeof(TESTS) / sizeof(TESTS[0]);
+
+} /* End of anonymous namespace */
+
+/* Runs the tests named on the command line, all of them without arguments. Returns the
+ * number of tests failed. */
+int main(int argc, char* argv[]) {
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        bool known = false;
+        for (int t = 0; t < TEST_COUNT; t++) {
+            known = known || strcmp(argv[i], TESTS[t].name) == 0;
+        }
+        if (!known) {
+            fprintf(stderr, "Unknown test: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    for (int t = 0; t < TEST_COUNT; t++) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++) {
+            selected = selected || strcmp(argv[i], TESTS[t].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+        bool passed = TESTS[t].run();
+        printf("%-10s %s\n", TESTS[t].name, passed ? "passed" : "FAILED");
+        failed += passed ? 0 : 1;
+    }
+    return failed;
+}
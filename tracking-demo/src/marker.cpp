@@ -15,237 +15,587 @@
  */
 
 #include "marker.h"
-
-// Using a multimap for tracking labelled objects.
-#include <map>
+#include <cfloat>
+#include <cmath>
 
 namespace marker {
 
-void thresholdImage(cv::Mat &image, cv::Mat& grey, cv::Mat &binary, int windowSize, int C) {
-    double maximum   = 1;
+void Scanner::findLabels(cv::Mat &image, cv::Mat &binary, int windowSize, int C) {
+    // Grey scale conversion and adaptive threshold on the image
+    thresholder.apply(image, greyImage, binary, windowSize, C);
+	// The same opening as findMarkers(), for the debug view to show what is labeled.
+	if (openingSize > 0) {
+		opening.apply(binary, openingSize);
+	}
 
-    // First convert the image to grayscale
-    cv::cvtColor(image, grey, CV_BGR2GRAY);
+	// Mark all the connected components in the binary image, and turn the binary image
+	// into a grey scale image for debug.
+	labeler.label(binary, componentStats, centroids, components.parent);
+	labeler.draw(labelImage);
+	for (int y = 0; y < binary.rows; y++) {
+		for (int x = 0; x < binary.cols; x++) {
+			binary.at<uint8_t>(y,x) = (labelImage.at<int>(y,x)*37) % 256;
+		}
+	}
+}
 
-    // Adaptive threshold on the image
-    cv::adaptiveThreshold(grey, binary, maximum, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, windowSize, C);
+const std::vector<marker::Marker>& Scanner::findMarkers(cv::Mat& frame, int windowSize, int C) {
+	markers.clear();
+
+	TRACE_BEGIN_FRAME(stats);
+	{
+		TRACE_SCOPE(stats, STAGE_FRAME);
+		scanFrame(frame, windowSize, C);
+		decodeMarkers();
+	}
+	TRACE_END_FRAME(stats);
+	return markers;
 }
 
+const std::vector<marker::Marker>& Scanner::findMarkers(const uchar* grey, int width, int height, size_t stride,
+                                                        int windowSize, int C) {
+	// Only a header over the caller's buffer, shared with greyImage until a colour frame
+	// comes: the scanner reads the grey image, it never writes to it, see scanFrame().
+	cv::Mat frame(height, width, CV_8UC1, const_cast<uchar*>(grey), stride);
+	return findMarkers(frame, windowSize, C);
+}
 
-void erode(cv::Mat &src, cv::Mat &dst, int erosionSize) {
-  int erosionType = cv::MORPH_RECT;
-  // erosionType = cv::MORPH_CROSS;
-  // erosionType = cv::MORPH_ELLIPSE;
+void Scanner::scanFrame(cv::Mat& frame, int windowSize, int C) {
+	cv::Rect image(0, 0, frame.cols, frame.rows);
 
-  cv::Mat element = cv::getStructuringElement( erosionType,
-                                       Size( 2*erosionSize + 1, 2*erosionSize+1 ),
-                                       Point( erosionSize, erosionSize ) );
+	if (frame.type() == CV_8UC1) {
+		greyImage = frame;
+		greySharesFrame = true;
+	} else {
+		// After a grey frame of the same size, create() would keep the caller's pixels and
+		// the conversion would write to them.
+		if (greySharesFrame) {
+			greyImage.release();
+			greySharesFrame = false;
+		}
+		greyImage.create(frame.size(), CV_8UC1);
+	}
+	binaryImage.create(frame.size(), CV_8UC1);
 
-  // Apply the erosion operation
-  cv::erode( src, dst, element );
+	/* In tracking mode, only scan around the predicted positions of the markers. When
+	 * one of them is not found again, the frame gets a full scan. Outside of the scanned
+	 * regions the grey and binary images are left as they were. */
+	if (tracking && !tracks.empty() && framesSinceFullScan + 1 < fullScanInterval) {
+		predictRegions(image, windowSize);
+		for (size_t i = 0; i < regions.size(); i++) {
+			scanRegion(frame, regions[i], greyImage, binaryImage, windowSize, C, NULL);
+		}
+		TRACE_COUNT(stats, COUNTER_REGIONS, regions.size());
+		if (updateTracks(true)) {
+			framesSinceFullScan++;
+			return;
+		}
+		markers.clear();
+	}
+	TRACE_COUNT(stats, COUNTER_FULL_SCANS, 1);
+	if (pyramidLevels > 0) {
+		scanPyramid(frame, windowSize, C);
+	} else {
+		scanRegion(frame, image, greyImage, binaryImage, windowSize, C, NULL);
+	}
+	if (tracking) {
+		updateTracks(false);
+	}
+	framesSinceFullScan = 0;
 }
 
-void dilate(cv::Mat &src, cv::Mat &dst, int dilationSize) {
-  int dilationType = cv::MORPH_RECT;
-  // dilationType = cv::MORPH_CROSS;
-  // dilationType = cv::MORPH_ELLIPSE;
+/* The regions are the predicted bounding boxes of the markers with a margin for the
+ * motion and for the threshold window, the overlapping ones are merged. */
+void Scanner::predictRegions(const cv::Rect& image, int windowSize) {
+	regions.clear();
+	for (size_t i = 0; i < tracks.size(); i++) {
+		const Track& track = tracks[i];
+		cv::Point2f center = track.center + track.velocity;
+		float half = track.size * (0.5f + trackingMargin) + (float)cv::norm(track.velocity) + windowSize;
+		cv::Rect region((int)(center.x - half), (int)(center.y - half), (int)(2 * half) + 1, (int)(2 * half) + 1);
+		region &= image;
+		if (region.area() > 0) {
+			regions.push_back(region);
+		}
+	}
+	mergeRegions();
+}
 
-  cv::Mat element = cv::getStructuringElement( dilationType,
-                                       Size( 2*dilationSize + 1, 2*dilationSize+1 ),
-                                       Point( dilationSize, dilationSize ) );
+namespace {
 
-  // Apply the dilation operation
-  cv::dilate( src, dst, element );
+/* The mean of each factor x factor block of the image, rounded, as cv::resize with
+ * INTER_AREA gives it for a whole factor, up to the rounding of the halves. The image
+ * keeps its buffer from one frame to the next, cv::resize allocates its tables on
+ * each call. */
+void downsample(const cv::Mat& frame, cv::Mat& image, int factor) {
+	const int channels = frame.channels();
+	const int area = factor * factor;
+	image.create(frame.rows / factor, frame.cols / factor, frame.type());
+	for (int y = 0; y < image.rows; y++) {
+		uchar* dst = image.ptr<uchar>(y);
+		for (int x = 0; x < image.cols * channels; x++) {
+			int channel = x % channels;
+			int left = (x - channel) * factor + channel;
+			int sum = 0;
+			for (int dy = 0; dy < factor; dy++) {
+				const uchar* src = frame.ptr<uchar>(y * factor + dy) + left;
+				for (int dx = 0; dx < factor; dx++) {
+					sum += src[dx * channels];
+				}
+			}
+			dst[x] = (uchar)((sum + area / 2) / area);
+		}
+	}
 }
 
-void Scanner::findLabels(cv::Mat &image, cv::Mat &binary, int windowSize, int C) {
-    double maximum   = 255;
-    cv::Mat grey;
-    cv::Mat tmp;
-    cv::Mat labelImage;
-    //cv::Mat labelInvertedImage;
-    cv::Mat stats;
-    cv::Mat centroid;
-    //cv::Mat binaryInverted;
-    int rows;
-
-    // First convert the image to grayscale
-    cv::cvtColor(image, grey, CV_BGR2GRAY);
-
-    // Adaptive threshold on the image
-    cv::adaptiveThreshold(grey, binary, maximum, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, windowSize, C);
-	erode(binary, tmp, 1);
-	dilate(tmp, binary, 1);
-	cv::threshold(binary, binaryInvertedImage, 0, maximum, cv::THRESH_BINARY_INV);
+} /* End of anonymous namespace */
 
-	// Mark all the connected components in the binary image, and turn the binary image
-	// into a grey scale image for debug.
-	cv::connectedComponentsWithStats(binary, labelImage, stats, centroid, 4, CV_16U);
-	rows = stats.rows;
-	cv::connectedComponentsWithStats(binaryInvertedImage, labelInvertedImage, stats, centroid, 4, CV_16U);
-	labelImage += (labelInvertedImage+rows);
-	for (int y = 0; y < binary.rows; y++) {
-		for (int x = 0; x < binary.cols; x++) {
-			binary.at<uint8_t>(y,x) = (labelImage.at<short>(y,x)*37) % 256;
+/* Coarse to fine search: the markers are detected on a downsampled frame with a window
+ * scaled down too, then each candidate is scanned at full resolution in its bounding box,
+ * where the corners are refined and the code read. Markers smaller than a few times the
+ * window of the downsampled frame are not found. */
+void Scanner::scanPyramid(cv::Mat& frame, int windowSize, int C) {
+	cv::Rect image(0, 0, frame.cols, frame.rows);
+	int factor = 1 << pyramidLevels;
+	int coarseWindowSize = (windowSize / factor) | 1;
+
+	{
+		TRACE_SCOPE(stats, STAGE_PYRAMID);
+		downsample(frame, pyramidImage, factor);
+	}
+	if (pyramidImage.empty()) {
+		return;
+	}
+	if (pyramidImage.type() == CV_8UC1) {
+		pyramidGreyImage = pyramidImage;
+	} else {
+		pyramidGreyImage.create(pyramidImage.size(), CV_8UC1);
+	}
+	pyramidBinaryImage.create(pyramidImage.size(), CV_8UC1);
+	candidates.clear();
+	scanRegion(pyramidImage, cv::Rect(0, 0, pyramidImage.cols, pyramidImage.rows), pyramidGreyImage, pyramidBinaryImage,
+	           coarseWindowSize < 3 ? 3 : coarseWindowSize, C, &candidates);
+
+	double scaleX = (double)frame.cols / pyramidImage.cols;
+	double scaleY = (double)frame.rows / pyramidImage.rows;
+	regions.clear();
+	for (size_t i = 0; i < candidates.size(); i++) {
+		const cv::Rect& box = candidates[i];
+		int margin = (int)((box.width > box.height ? box.width : box.height) * scaleX * trackingMargin) + windowSize;
+		cv::Rect region((int)(box.x * scaleX) - margin, (int)(box.y * scaleY) - margin,
+		                (int)(box.width * scaleX) + 2 * margin, (int)(box.height * scaleY) + 2 * margin);
+		region &= image;
+		if (region.area() > 0) {
+			regions.push_back(region);
 		}
 	}
+	mergeRegions();
+	for (size_t i = 0; i < regions.size(); i++) {
+		scanRegion(frame, regions[i], greyImage, binaryImage, windowSize, C, NULL);
+	}
+	TRACE_COUNT(stats, COUNTER_REGIONS, regions.size());
 }
 
-typedef struct {
-	int area;
-	int label;
-	int parentLabel;
-	int childCount;
-	int totalChildCount;
-	int children[5]; // Valid markers have 5 children
-	cv::Point2f topLeft;
-	cv::Point2f bottomRight;
-	cv::Point2f center;
-} Component;
+void Scanner::mergeRegions() {
+	for (size_t i = 0; i < regions.size(); i++) {
+		for (size_t j = i + 1; j < regions.size(); j++) {
+			if ((regions[i] & regions[j]).area() > 0) {
+				regions[i] |= regions[j];
+				regions.erase(regions.begin() + j);
+				// The merged region may now overlap earlier ones, start over.
+				i = (size_t)-1;
+				break;
+			}
+		}
+	}
+}
 
-/* Better implementation which uses Connected Components APIs for the labeling.  */
-void Scanner::findMarkers(cv::Mat& frame, int windowSize, int C, std::vector<marker::Marker*>& markers) {
-	cv::Mat stats, centroid;
-	cv::Mat statsInverted, centroidInverted;
-	std::multimap<int, int> componentsSortedByBoxArea;
-	std::vector<Component> components;
-	int maximum = 1;
-	int openingSize = 1;
+/* The codes of all the markers of the frame are decoded at once, see CodeDecoder. The
+ * codewords that do not decode get a second chance with their weakest bytes erased. */
+void Scanner::decodeMarkers() {
+	TRACE_SCOPE(stats, STAGE_DECODE);
+	const int count = (int)markers.size();
+	codewords.resize(count * CODE_LENGTH);
+	messages.resize(count * CODE_MESSAGE_LENGTH);
+	codeStatus.resize(count);
+	for (int m = 0; m < count; m++) {
+		memcpy(&codewords[m * CODE_LENGTH], markers[m].codeword, CODE_LENGTH);
+	}
+	if (count > 0) {
+		decoder.decode(&codewords[0], &messages[0], &codeStatus[0], count);
+	}
+	for (int m = 0; m < count; m++) {
+		Marker& marker = markers[m];
+		if (codeStatus[m] == CODE_INVALID) {
+			uint8_t* message = &messages[m * CODE_MESSAGE_LENGTH];
+			codeStatus[m] = decodeWithErasures(marker.codeword, marker.codeConfidence, message);
+			if (codeStatus[m] != CODE_INVALID) {
+				TRACE_COUNT(stats, COUNTER_DECODE_ERASURES, 1);
+			}
+		}
+		marker.hasValidCode = codeStatus[m] != CODE_INVALID;
+		if (marker.hasValidCode) {
+			memcpy(marker.codeValue, &messages[m * CODE_MESSAGE_LENGTH], CODE_MESSAGE_LENGTH);
+			TRACE_COUNT(stats, COUNTER_DECODE_SUCCESS, 1);
+		} else {
+			TRACE_COUNT(stats, COUNTER_DECODE_FAILURE, 1);
+		}
+		if (codeStatus[m] == CODE_CORRECTED) {
+			TRACE_COUNT(stats, COUNTER_DECODE_CORRECTED, 1);
+		}
+	}
+}
 
-	/* Warning: it is the responsibility of the code calling this function to de-allocate the Markers in this vector. */
-	markers.clear();
+/* Replace the tracks with the markers of this frame, keeping the velocity of the markers
+ * found near their predicted position. Returns false if a track was lost. After a
+ * partial scan that lost a track, the tracks are left as they were: the full scan that
+ * follows is matched with them, and keeps the velocities of the markers found again. */
+bool Scanner::updateTracks(bool partial) {
+	bool allFound = true;
+
+	updatedTracks.resize(markers.size());
+	for (size_t m = 0; m < markers.size(); m++) {
+		const Marker& marker = markers[m];
+		float first = (float)cv::norm(marker.two[0] - marker.zero);
+		float second = (float)cv::norm(marker.three[0] - marker.one);
+		updatedTracks[m].center = marker.center;
+		updatedTracks[m].velocity = cv::Point2f(0, 0);
+		updatedTracks[m].size = first > second ? first : second;
+	}
+	for (size_t t = 0; t < tracks.size(); t++) {
+		cv::Point2f predicted = tracks[t].center + tracks[t].velocity;
+		double best = tracks[t].size * 0.5;
+		int found = -1;
+		for (size_t m = 0; m < updatedTracks.size(); m++) {
+			double distance = cv::norm(updatedTracks[m].center - predicted);
+			if (distance < best) {
+				best = distance;
+				found = (int)m;
+			}
+		}
+		if (found >= 0) {
+			updatedTracks[found].velocity = updatedTracks[found].center - tracks[t].center;
+		} else {
+			allFound = false;
+		}
+	}
+	if (allFound || !partial) {
+		tracks.swap(updatedTracks);
+	}
+	return allFound;
+}
+
+namespace {
+
+const int REFINE_ITERATIONS = 40;
+
+inline int clampIndex(int i, int size) {
+	return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+} /* End of anonymous namespace */
+
+/* The window is 2 * windowSize + 3 pixels wide, centered on the corner. */
+void CornerRefiner::sampleWindow(const cv::Mat& grey, cv::Point2f center) {
+	const int side = 2 * windowSize + 3;
+	float x0 = center.x - (windowSize + 1);
+	float y0 = center.y - (windowSize + 1);
+	int left = (int)std::floor(x0);
+	int top = (int)std::floor(y0);
+	float a = x0 - left;
+	float b = y0 - top;
+	float w00 = (1.f - a) * (1.f - b), w01 = a * (1.f - b), w10 = (1.f - a) * b, w11 = a * b;
+	for (int i = 0; i < side; i++) {
+		const uchar* row0 = grey.ptr<uchar>(clampIndex(top + i, grey.rows));
+		const uchar* row1 = grey.ptr<uchar>(clampIndex(top + i + 1, grey.rows));
+		float* dst = &window[i * side];
+		for (int j = 0; j < side; j++) {
+			int x = clampIndex(left + j, grey.cols);
+			int x1 = clampIndex(left + j + 1, grey.cols);
+			dst[j] = w00 * row0[x] + w01 * row0[x1] + w10 * row1[x] + w11 * row1[x1];
+		}
+	}
+}
+
+void CornerRefiner::refine(const cv::Mat& grey, cv::Point2f* corners, int count, int windowSize) {
+	CV_Assert(grey.type() == CV_8UC1 && windowSize > 0);
+	const int size = 2 * windowSize + 1;
+	const int side = size + 2;
+	if (this->windowSize != windowSize) {
+		this->windowSize = windowSize;
+		weights.resize(size * size);
+		for (int i = 0; i < size; i++) {
+			float y = (float)(i - windowSize) / windowSize;
+			float vy = std::exp(-y * y);
+			for (int j = 0; j < size; j++) {
+				float x = (float)(j - windowSize) / windowSize;
+				weights[i * size + j] = (float)(vy * std::exp(-x * x));
+			}
+		}
+		window.resize(side * side);
+	}
+
+	for (int c = 0; c < count; c++) {
+		cv::Point2f start = corners[c], corner = start;
+		for (int iteration = 0; iteration < REFINE_ITERATIONS; iteration++) {
+			sampleWindow(grey, corner);
+			// The corner is where the gradients are orthogonal to the direction to the
+			// corner, in the least squares sense.
+			double a = 0, b = 0, d = 0, bb1 = 0, bb2 = 0;
+			const float* w = &window[side + 1];
+			for (int i = 0, k = 0; i < size; i++, w += side) {
+				double py = i - windowSize;
+				for (int j = 0; j < size; j++, k++) {
+					double m = weights[k];
+					double gx = w[j + 1] - w[j - 1];
+					double gy = w[j + side] - w[j - side];
+					double gxx = gx * gx * m;
+					double gxy = gx * gy * m;
+					double gyy = gy * gy * m;
+					double px = j - windowSize;
+					a += gxx;
+					b += gxy;
+					d += gyy;
+					bb1 += gxx * px + gxy * py;
+					bb2 += gxy * px + gyy * py;
+				}
+			}
+			double det = a * d - b * b;
+			if (fabs(det) <= DBL_EPSILON * DBL_EPSILON) {
+				break;
+			}
+			double scale = 1.0 / det;
+			cv::Point2f next((float)(corner.x + d * scale * bb1 - b * scale * bb2),
+			                 (float)(corner.y - b * scale * bb1 + a * scale * bb2));
+			bool moved = next.x != corner.x || next.y != corner.y;
+			corner = next;
+			if (!moved || corner.x < 0 || corner.x >= grey.cols || corner.y < 0 || corner.y >= grey.rows) {
+				break;
+			}
+		}
+		// Too far from the start, the refinement did not converge.
+		if (fabs(corner.x - start.x) > windowSize || fabs(corner.y - start.y) > windowSize) {
+			corner = start;
+		}
+		corners[c] = corner;
+	}
+}
+
+namespace {
+
+/* The bands of the tiled mode have at least this many rows, and at least 4 times the rows
+ * read around them: thinner bands would spend most of their time on the rows of their
+ * neighbours. */
+const int BAND_MIN_ROWS = 64;
+
+/* Rows above and below a band read by the threshold and the opening of its rows: the
+ * window of the threshold, then the erosion and the dilation of the opening. */
+int bandOverlap(int windowSize, int openingSize) {
+	return windowSize / 2 + 2 * openingSize;
+}
 
-	/* Turn the image into a binary image, and also compute the inverted binary image.
+} /* End of anonymous namespace */
+
+/* Number of bands the region is scanned in, 1 for the serial scan. There are twice as
+ * many bands as threads, so that the threads done first can steal the bands left. */
+int Scanner::bandCount(const cv::Rect& region, int windowSize) const {
+	if (threads <= 1) {
+		return 1;
+	}
+	int overlap = bandOverlap(windowSize, openingSize);
+	int minRows = 4 * overlap > BAND_MIN_ROWS ? 4 * overlap : BAND_MIN_ROWS;
+	int count = region.height / minRows;
+	return count < 2 * threads ? count : 2 * threads;
+}
+
+/* Threshold, opening and labeling of the bands of the image, on the pool of workers.
+ * Each band is thresholded and opened with the rows around it that these filters read,
+ * in its own buffers, so that the rows it keeps are the same as those of the whole
+ * image. Only its own rows are written to the grey and binary images and labeled. */
+void Scanner::labelBands(const cv::Mat& image, cv::Mat& grey, cv::Mat& binary, int windowSize, int C, int count) {
+	if (!workers || workers->size() != threads) {
+		workers.reset(new WorkerPool(threads));
+	}
+	if ((int)bands.size() < count) {
+		bands.resize(count);
+	}
+	labeler.beginBands(count, image.rows, image.cols);
+	bandJob.image = &image;
+	bandJob.grey = &grey;
+	bandJob.binary = &binary;
+	bandJob.windowSize = windowSize;
+	bandJob.C = C;
+	bandJob.count = count;
+	bandJob.overlap = bandOverlap(windowSize, openingSize);
+	// A grey image is shared with the frame, nothing to write.
+	bandJob.convert = image.type() != CV_8UC1;
+
+	// Only this is captured: the body fits in std::function, a frame does not allocate.
+	workers->parallelFor(count, [this](int b) { labelBand(b); });
+}
+
+/* Band b of the bandJob, in any thread of the pool. */
+void Scanner::labelBand(int b) {
+	const BandJob& job = bandJob;
+	const cv::Mat& image = *job.image;
+	Band& band = bands[b];
+	band.thresholder.setKernels(thresholder.getKernels());
+	int y0 = image.rows * b / job.count;
+	int y1 = image.rows * (b + 1) / job.count;
+	int top = y0 - job.overlap > 0 ? y0 - job.overlap : 0;
+	int bottom = y1 + job.overlap < image.rows ? y1 + job.overlap : image.rows;
+	band.thresholder.apply(image.rowRange(top, bottom), band.grey, band.binary, job.windowSize, job.C);
+	band.opening.apply(band.binary, openingSize);
+
+	cv::Mat bandBinary = job.binary->rowRange(y0, y1);
+	band.binary.rowRange(y0 - top, y1 - top).copyTo(bandBinary);
+	if (job.convert) {
+		cv::Mat bandGrey = job.grey->rowRange(y0, y1);
+		band.grey.rowRange(y0 - top, y1 - top).copyTo(bandGrey);
+	}
+	labeler.labelBand(b, bandBinary, y0);
+}
+
+/* Better implementation which uses Connected Components APIs for the labeling.
+ * Only the given region of the frame is processed, and written to the same region of the
+ * frame size grey and binary images; the markers are in frame coordinates. When
+ * candidates is set, only the bounding boxes of the markers found are reported there. */
+void Scanner::scanRegion(cv::Mat& frame, const cv::Rect& region, cv::Mat& greyFrame, cv::Mat& binaryFrame,
+                         int windowSize, int C, std::vector<cv::Rect>* candidates) {
+	cv::Mat grey = greyFrame(region);
+	cv::Mat binary = binaryFrame(region);
+	cv::Point2f offset((float)region.x, (float)region.y);
+
+	/* Turn the image into a binary image.
 	 *
 	 * The window size used for the thresholding influences the size of the markers that
 	 * can be discovered by the algorithm.
 	 *
 	 */
-	thresholdImage(frame, greyImage, binaryImage, windowSize, C);
-	/* Opening, should be optional for areas where we are trying to detect small size markers. */
-	if (openingSize > 0) {
-		erode(binaryImage, tmp, openingSize);
-		dilate(tmp, binaryImage, openingSize);
-	}
-	cv::threshold(binaryImage, binaryInvertedImage, 0, maximum, cv::THRESH_BINARY_INV);
-
-	// Mark all the connected components in the binary image.
-	cv::connectedComponentsWithStats(binaryImage, labelImage, stats, centroid, 4, CV_16U);
-	/* TODO Run these two "connected components" operations in separate threads. */
-	cv::connectedComponentsWithStats(binaryInvertedImage, labelInvertedImage, statsInverted, centroidInverted, 4, CV_16U);
-	/* Merge the two labelled images.  */
-#ifndef DISABLE_MATRIX_OPS
-	binaryInvertedImage.convertTo(binaryInvertedImage, CV_16U);
-	labelInvertedImage += (binaryInvertedImage*stats.rows);
-	labelImage += labelInvertedImage;
-#else
-	for (int y=0; y<labelInvertedImage.rows; y++) {
-		for (int x=0; x<labelInvertedImage.cols; x++) {
-			short value = labelInvertedImage.at<short>(y,x);
-			if (value > 0) {
-				labelImage.at<short>(y,x) += value + stats.rows;
+	const int tiles = bandCount(region, windowSize);
+	if (tiles > 1) {
+		/* Tiled mode: the same three steps in bands, then the bands are joined. */
+		{
+			TRACE_SCOPE(stats, STAGE_BANDS);
+			labelBands(frame(region), grey, binary, windowSize, C, tiles);
+		}
+		TRACE_SCOPE(stats, STAGE_LABEL);
+		labeler.endBands(componentStats, centroids, components.parent);
+	} else {
+		{
+			TRACE_SCOPE(stats, STAGE_THRESHOLD);
+			thresholder.apply(frame(region), grey, binary, windowSize, C);
+		}
+		/* Opening, can be disabled when trying to detect small size markers. */
+		if (openingSize > 0) {
+			TRACE_SCOPE(stats, STAGE_OPENING);
+			opening.apply(binary, openingSize);
+		}
+		/* Mark all the connected components, white and black, in the binary image. */
+		TRACE_SCOPE(stats, STAGE_LABEL);
+		labeler.label(binary, componentStats, centroids, components.parent);
+	}
+	const int count = componentStats.rows;
+	components.reset(count);
+	TRACE_COUNT(stats, COUNTER_COMPONENTS, count - 1);
+
+	/* Only keep the components that do not touch any of the sides of the region. */
+	{
+		TRACE_SCOPE(stats, STAGE_FILTER);
+		for (int label = 1; label < count; label++) {
+			// label zero is skipped, it is not used by the labeler
+			const int* s = componentStats.ptr<int>(label);
+			if ( s[cv::CC_STAT_TOP] > 0
+			  && s[cv::CC_STAT_LEFT] > 0
+			  && (s[cv::CC_STAT_TOP] + s[cv::CC_STAT_HEIGHT]) < (binary.rows-1)
+			  && (s[cv::CC_STAT_LEFT] + s[cv::CC_STAT_WIDTH]) < (binary.cols-1)) {
+				const double* c = centroids.ptr<double>(label);
+				components.inside[label] = 1;
+				components.area[label] = s[cv::CC_STAT_AREA];
+				components.bbox[label] = cv::Rect(s[cv::CC_STAT_LEFT] + region.x, s[cv::CC_STAT_TOP] + region.y,
+				                                  s[cv::CC_STAT_WIDTH], s[cv::CC_STAT_HEIGHT]);
+				components.center[label] = cv::Point2f((float)c[0], (float)c[1]) + offset;
 			}
 		}
 	}
-#endif
-	// Combine the stats and centroid arrays.
-	stats.push_back(statsInverted);
-	centroid.push_back(centroidInverted);
-	components.reserve(stats.rows);
-
-	/* Only keep the components that do not touch any of the sides of the image, and
-	   sort them by their bounding box area. */
-	for (int label = 1; label<stats.rows; label++) {
-		// label zero is skipped, as it is the background label of the first
-		// pass of the connected component computation
-		Component& component = components[label];
-		component.parentLabel = -1;
-		component.childCount = 0;
-		component.totalChildCount = 0;
-		component.label = label;
-		component.children[0] = -1;
-		if ( stats.at<int>(label,cv::CC_STAT_TOP) > 0
-		  && stats.at<int>(label,cv::CC_STAT_LEFT) > 0
-		  && (stats.at<int>(label,cv::CC_STAT_TOP)+stats.at<int>(label,cv::CC_STAT_HEIGHT)) < (binaryImage.rows-1)
-		  && (stats.at<int>(label,cv::CC_STAT_LEFT)+stats.at<int>(label,cv::CC_STAT_WIDTH)) < (binaryImage.cols-1)) {
-			int boxArea = stats.at<int>(label,cv::CC_STAT_WIDTH)*stats.at<int>(label,cv::CC_STAT_HEIGHT);
-			componentsSortedByBoxArea.insert(std::pair<int,int>(boxArea, label));
-			component.topLeft.x = stats.at<int>(label,cv::CC_STAT_LEFT);
-			component.topLeft.y = stats.at<int>(label,cv::CC_STAT_TOP);
-			component.bottomRight.x = stats.at<int>(label,cv::CC_STAT_LEFT)+stats.at<int>(label,cv::CC_STAT_WIDTH);
-			component.bottomRight.y = stats.at<int>(label,cv::CC_STAT_TOP)+stats.at<int>(label,cv::CC_STAT_HEIGHT);
-			component.center.x  = centroid.at<double>(label,0);
-			component.center.y  = centroid.at<double>(label,1);
-			component.area      = stats.at<int>(label,cv::CC_STAT_AREA);
-		}
-	}
-
-	/* For each component determine which other component (if any) it is included in. */
-	for (auto it = componentsSortedByBoxArea.begin(); it != componentsSortedByBoxArea.end(); it++) {
-		int label = it->second;
-		int x = components[label].topLeft.x - 1;
-		int y = components[label].topLeft.y;
-	    int currentLabel = labelImage.at<short>(y, x++);
-	    int previousLabel = currentLabel;
-	    int iterationCount = 0;
-
-		while ((currentLabel = labelImage.at<short>(y, x++)) != label) {
-			previousLabel = currentLabel;
-			iterationCount++;
-		}
-		/* Record the parent of this label. */
-		components[label].parentLabel = previousLabel;
-		if (components[previousLabel].childCount < 5) {
-			components[previousLabel].children[components[previousLabel].childCount] = label;
-		}
-		components[previousLabel].childCount++;
-		components[previousLabel].totalChildCount += components[label].totalChildCount + 1;
+
+	/* Link each component to its parent, using the containment tree built by the labeler.
+	 * Parents have smaller labels than their children, so in decreasing label order all the
+	 * descendants of a component have been counted when it is reached. Only the
+	 * inside, parent, count and link arrays are touched until a marker is found. */
+	TRACE_SCOPE(stats, STAGE_TOPOLOGY);
+	const uint8_t* inside = &components.inside[0];
+	const int* parent = &components.parent[0];
+	int* childCount = &components.childCount[0];
+	int* totalChildCount = &components.totalChildCount[0];
+	int* firstChild = &components.firstChild[0];
+	int* nextSibling = &components.nextSibling[0];
+	for (int label = count - 1; label > 0; label--) {
+		if (!inside[label]) {
+			continue;
+		}
+		/* Record this label as a child of its parent. */
+		int parentLabel = parent[label];
+		nextSibling[label] = firstChild[parentLabel];
+		firstChild[parentLabel] = label;
+		childCount[parentLabel]++;
+		totalChildCount[parentLabel] += totalChildCount[label] + 1;
 		/* If the current label meets the marker requirements, record it for later use.  */
-		if (components[label].childCount == 5 && components[label].totalChildCount == 11) {
-			int histogram[] = {0, 0, 0, 0};
-			for (int child = 0; child < 5; child++) {
-				int childLabel = components[label].children[child];
-				if (childLabel > 0 && components[childLabel].totalChildCount >= 0 && components[childLabel].totalChildCount < 4) {
-					histogram[components[childLabel].totalChildCount]++;
-				}
+		if (childCount[label] != 5 || totalChildCount[label] != 11) {
+			continue;
+		}
+		int histogram[] = {0, 0, 0, 0};
+		for (int child = firstChild[label]; child != 0; child = nextSibling[child]) {
+			if (totalChildCount[child] < 4) {
+				histogram[totalChildCount[child]]++;
 			}
-			if (histogram[0] == 2 && histogram[1] == 1 && histogram[2] == 1 && histogram[3] == 1) {
-				/* We have found what really looks like a marker, create a new Marker object */
-				marker::Marker *newMarker = new Marker();
-				newMarker->center = components[label].center;
-				int zeroArea = 10000;
-				for (int child = 0; child < 5; child++) {
-					int childLabel = components[label].children[child];
-
-					switch (components[childLabel].totalChildCount) {
-					case 0:
-						if (components[childLabel].area < zeroArea) {
-							newMarker->zero.x = components[childLabel].center.x;
-							newMarker->zero.y = components[childLabel].center.y;
-							zeroArea = components[childLabel].area;
-						}
-						break;
-					case 1:
-						newMarker->one = components[components[childLabel].children[0]].center;
-						break;
-					case 2:
-						newMarker->two[0] = components[components[childLabel].children[0]].center;
-						newMarker->two[1] = components[components[childLabel].children[1]].center;
-						break;
-					case 3:
-						newMarker->three[0] = components[components[childLabel].children[0]].center;
-						newMarker->three[1] = components[components[childLabel].children[1]].center;
-						newMarker->three[2] = components[components[childLabel].children[2]].center;
-						break;
-					}
+		}
+		if (histogram[0] != 2 || histogram[1] != 1 || histogram[2] != 1 || histogram[3] != 1) {
+			continue;
+		}
+		if (candidates) {
+			TRACE_COUNT(stats, COUNTER_COARSE_CANDIDATES, 1);
+			candidates->push_back(components.bbox[label]);
+			continue;
+		}
+		/* We have found what really looks like a marker, add it to the markers */
+		TRACE_COUNT(stats, COUNTER_CANDIDATES, 1);
+		markers.push_back(Marker());
+		marker::Marker *newMarker = &markers.back();
+		newMarker->center = components.center[label];
+		int zeroArea = 10000;
+		for (int child = firstChild[label]; child != 0; child = nextSibling[child]) {
+			int grandChild = firstChild[child];
+			switch (totalChildCount[child]) {
+			case 0:
+				if (components.area[child] < zeroArea) {
+					newMarker->zero = components.center[child];
+					zeroArea = components.area[child];
 				}
-				newMarker->normalize();
-				newMarker->cornerSubPix(greyImage, 5, -1);
-				newMarker->readCode(greyImage, codeImage);
-				markers.push_back(newMarker);
+				break;
+			case 1:
+				newMarker->one = components.center[grandChild];
+				break;
+			case 2:
+				newMarker->two[0] = components.center[grandChild];
+				newMarker->two[1] = components.center[nextSibling[grandChild]];
+				break;
+			case 3:
+				newMarker->three[0] = components.center[grandChild];
+				newMarker->three[1] = components.center[nextSibling[grandChild]];
+				newMarker->three[2] = components.center[nextSibling[nextSibling[grandChild]]];
+				break;
 			}
 		}
+		newMarker->normalize();
+		refiner.refine(greyImage, newMarker->codeCorners, 4, 5);
+		{
+			TRACE_SCOPE(stats, STAGE_READ_CODE);
+			newMarker->sampleCode(greyImage);
+		}
+		if (drawCodes) {
+			newMarker->drawCode(greyImage, codeImage);
+		}
 	}
-	components.clear();
 }
 } /* End of namespace  */
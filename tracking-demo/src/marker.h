@@ -22,8 +22,15 @@
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <iostream>
+#include <memory>
 #include <vector>
-#include "rs.hpp"
+#include <string.h>
+#include "codes.h"
+#include "label.h"
+#include "opening.h"
+#include "threshold.h"
+#include "trace.h"
+#include "workers.h"
 
 using namespace std;
 using namespace cv;
@@ -45,6 +52,50 @@ inline bool lineIntersection(cv::Point2f o1, cv::Point2f p1, cv::Point2f o2, cv:
 	return true;
 }
 
+/* Same as cv::getPerspectiveTransform, solved on the stack. */
+inline cv::Matx33d perspectiveTransform(const cv::Point2f src[4], const cv::Point2f dst[4]) {
+	cv::Matx<double, 8, 8> a;
+	cv::Matx<double, 8, 1> b;
+	for (int i = 0; i < 4; i++) {
+		a(i, 0) = a(i + 4, 3) = src[i].x;
+		a(i, 1) = a(i + 4, 4) = src[i].y;
+		a(i, 2) = a(i + 4, 5) = 1;
+		a(i, 3) = a(i, 4) = a(i, 5) = 0;
+		a(i + 4, 0) = a(i + 4, 1) = a(i + 4, 2) = 0;
+		a(i, 6) = -src[i].x * dst[i].x;
+		a(i, 7) = -src[i].y * dst[i].x;
+		a(i + 4, 6) = -src[i].x * dst[i].y;
+		a(i + 4, 7) = -src[i].y * dst[i].y;
+		b.val[i] = dst[i].x;
+		b.val[i + 4] = dst[i].y;
+	}
+	cv::Matx<double, 8, 1> x = a.solve(b, cv::DECOMP_LU);
+	return cv::Matx33d(x.val[0], x.val[1], x.val[2], x.val[3], x.val[4], x.val[5], x.val[6], x.val[7], 1);
+}
+
+/* Grey level at p, interpolated between the 4 nearest pixels. The points outside of the
+ * image read the nearest pixel of the border. */
+inline float interpolateGrey(const cv::Mat& grey, cv::Point2f p) {
+	float x = p.x < 0 ? 0 : (p.x > grey.cols - 1 ? grey.cols - 1 : p.x);
+	float y = p.y < 0 ? 0 : (p.y > grey.rows - 1 ? grey.rows - 1 : p.y);
+	int x0 = (int)x, y0 = (int)y;
+	int x1 = x0 + 1 < grey.cols ? x0 + 1 : x0;
+	int y1 = y0 + 1 < grey.rows ? y0 + 1 : y0;
+	float fx = x - x0, fy = y - y0;
+	const uint8_t* top = grey.ptr<uint8_t>(y0);
+	const uint8_t* bottom = grey.ptr<uint8_t>(y1);
+	return (top[x0] * (1 - fx) + top[x1] * fx) * (1 - fy) + (bottom[x0] * (1 - fx) + bottom[x1] * fx) * fy;
+}
+
+/* The code area, straightened to a 256x128 image by the homography of its corners, and
+ * the centers of the 10 bytes (columns) of 8 bits (rows) in it. */
+const int CODE_AREA_WIDTH = 256;
+const int CODE_AREA_HEIGHT = 128;
+
+inline cv::Point2f codeBitCenter(int x, int y) {
+	return cv::Point2f(x*18.2f + 46, y*15.9f + 7.5f);
+}
+
 class Marker {
 public:
 	cv::Point2f center;
@@ -53,13 +104,25 @@ public:
 	cv::Point2f two[2];
 	cv::Point2f three[3];
 	/** Rectangle in which the code is included. */
-	std::vector<cv::Point2f> codeCorners;
+	cv::Point2f codeCorners[4];
 	bool        hasValidCode;
 	uint8_t     codeValue[4];
+	/** The code as sampled, before the error correction. */
+	uint8_t     codeword[CODE_LENGTH];
+	/** Per byte of codeword, the smallest distance in grey levels of one of its bits to
+	 * the local threshold. The least confident bytes are erased when decoding fails. */
+	uint8_t     codeConfidence[CODE_LENGTH];
 
 	Marker () {
 		hasValidCode = false;
-		codeCorners.resize(4);
+	}
+
+	/* Corners of the straightened code area, in the order of codeCorners. */
+	static void codeArea(cv::Point2f corners[4]) {
+		corners[0] = cv::Point2f(0, CODE_AREA_HEIGHT);
+		corners[1] = cv::Point2f(0, 0);
+		corners[2] = cv::Point2f(CODE_AREA_WIDTH, 0);
+		corners[3] = cv::Point2f(CODE_AREA_WIDTH, CODE_AREA_HEIGHT);
 	}
 
 	void normalize() {
@@ -171,60 +234,73 @@ public:
 		// FIXME handle impossible error cases here.
 	}
 
-	void cornerSubPix(cv::Mat& greyImage, int windowSize, int zeroSize) {
-		// Set the needed parameters to find the refined corners
-		cv::Size winSize = Size( windowSize, windowSize );
-		cv::Size zeroZone = Size( zeroSize, zeroSize );
-		cv::TermCriteria criteria = cv::TermCriteria( /* CV_TERMCRIT_EPS + */ CV_TERMCRIT_ITER, 40, 0.001 );
+	/* Reads the bits of the code into codeword, and their confidence, without decoding
+	 * them. Only the 80 bits are read from the grey image, at the centers of their cells
+	 * projected by the homography of the code area, each one the mean of 3x3 points
+	 * spread over the middle of the cell.
+	 *
+	 * The threshold is half way between the grey levels of the parts of the marker known
+	 * to be black, the 6 dots, and of those known to be white, the inside of the zero
+	 * circle and the middle of the square. */
+	void sampleCode(const cv::Mat& greyImage) {
+		cv::Point2f area[4];
+		codeArea(area);
+		cv::Matx33d toImage = perspectiveTransform(area, codeCorners);
 
-		// Calculate the refined corner locations
-		cv::cornerSubPix(greyImage, codeCorners, winSize, zeroZone, criteria);
-	}
+		float black = (interpolateGrey(greyImage, one) + interpolateGrey(greyImage, two[0])
+		             + interpolateGrey(greyImage, two[1]) + interpolateGrey(greyImage, three[0])
+		             + interpolateGrey(greyImage, three[1]) + interpolateGrey(greyImage, three[2])) / 6;
+		float white = (interpolateGrey(greyImage, zero) + interpolateGrey(greyImage, center)) / 2;
+		float threshold = (black + white) / 2;
 
-	bool readCode(cv::Mat& greyImage, cv::Mat& binaryImage) {
-		// Define the destination image
-		cv::Mat codeImage = cv::Mat::zeros(128, 256, CV_8UC1);
-		int windowSize = 41, C = 10; // Make these parameters?
-
-		// Corners of the destination image
-		std::vector<cv::Point2f> fourPointArea;
-		fourPointArea.push_back(cv::Point2f(0, codeImage.rows));
-		fourPointArea.push_back(cv::Point2f(0, 0));
-		fourPointArea.push_back(cv::Point2f(codeImage.cols, 0));
-		fourPointArea.push_back(cv::Point2f(codeImage.cols, codeImage.rows));
-
-		// Get transformation matrix
-		cv::Mat transform = cv::getPerspectiveTransform(codeCorners, fourPointArea);
-
-		// Apply perspective transformation
-		cv::warpPerspective(greyImage, codeImage, transform, codeImage.size());
-	    // Adaptive threshold on the image
-	    cv::adaptiveThreshold(codeImage, binaryImage, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, windowSize, C);
-		uint8_t encodedCode[10];
 		for (int x = 0; x < 10; x++) {
-			encodedCode[x] = 0;
+			codeword[x] = 0;
+			float confidence = 255;
 			for (int y = 0; y < 8; y++) {
-				if (binaryImage.at<uint8_t>((int)(y*15.9+7.5), (int)(x*18.2+46)) == 0) {
-					encodedCode[x] |= 1 << y;
+				cv::Point2f cell = codeBitCenter(x, y);
+				float sum = 0;
+				for (int dy = -1; dy <= 1; dy++) {
+					for (int dx = -1; dx <= 1; dx++) {
+						cv::Vec3d p = toImage * cv::Vec3d(cell.x + dx*18.2f/4, cell.y + dy*15.9f/4, 1);
+						sum += interpolateGrey(greyImage, cv::Point2f(p[0] / p[2], p[1] / p[2]));
+					}
 				}
+				float margin = sum / 9 - threshold;
+				if (margin < 0) {
+					codeword[x] |= 1 << y;
+					margin = -margin;
+				}
+				confidence = margin < confidence ? margin : confidence;
 			}
+			codeConfidence[x] = (uint8_t)confidence;
 		}
-		for (float x = 0; x < 10; x++) {
-			for (float y = 0; y < 8; y++) {
-				cv::circle(binaryImage, cv::Point(x*18.2+46, y*15.9+7.5), 2, cv::Scalar(128));
-			}
-		}
+	}
 
-		RS::ReedSolomon<4 /*Message length */, 6 /* ECC length*/> rs;
-		if (rs.Decode(encodedCode, codeValue) == RESULT_SUCCESS) {
-			hasValidCode = true;
-			return true;
-		} else {
-			hasValidCode = false;
-			return false;
+	/* Samples and decodes the code of this marker alone, the Scanner decodes the codes of
+	 * all the markers of a frame at once with a CodeDecoder. */
+	bool readCode(const cv::Mat& greyImage) {
+		sampleCode(greyImage);
+		hasValidCode = MarkerCodec::decode(codeword, codeValue) != CODE_INVALID
+		            || decodeWithErasures(codeword, codeConfidence, codeValue) != CODE_INVALID;
+		return hasValidCode;
+	}
+
+	/* For debugging: the code area straightened in codeImage, with a circle around each
+	 * bit, white for 1 (black cell) and black for 0. */
+	void drawCode(const cv::Mat& greyImage, cv::Mat& codeImage) const {
+		cv::Point2f area[4];
+		codeArea(area);
+		codeImage.create(CODE_AREA_HEIGHT, CODE_AREA_WIDTH, CV_8UC1);
+		cv::warpPerspective(greyImage, codeImage, perspectiveTransform(codeCorners, area), codeImage.size());
+		for (int x = 0; x < 10; x++) {
+			for (int y = 0; y < 8; y++) {
+				int bit = (codeword[x] >> y) & 1;
+				cv::circle(codeImage, codeBitCenter(x, y), 3, cv::Scalar(255 * bit));
+			}
 		}
 	}
-	void drawGrey(cv::Mat &image) {
+
+	void drawGrey(cv::Mat &image) const {
 		cv::circle(image, center, 2, cv::Scalar(128));
 		cv::circle(image, zero, 2, cv::Scalar(255));
 		cv::circle(image, one, 2, cv::Scalar(255));
@@ -238,7 +314,7 @@ public:
 		cv::circle(image,codeCorners[2], 2, cv::Scalar(128));
 		cv::circle(image,codeCorners[3], 2, cv::Scalar(128));
 	}
-	void drawColor(cv::Mat &image) {
+	void drawColor(cv::Mat &image) const {
 		int red = 1;
 		int green = 1;
 		if (hasValidCode) {
@@ -261,24 +337,184 @@ public:
 	}
 };
 
+/* Sub-pixel refinement of corners, the iterations of cv::cornerSubPix without a dead zone
+ * and with at most 40 of them, which the scanner used before. The window around the
+ * corner is sampled by bilinear interpolation, with the border of the image replicated.
+ * cv::cornerSubPix allocates its weights and window on each call, the refiner keeps
+ * them: refining the corners of a frame does not allocate. */
+class CornerRefiner {
+public:
+	CornerRefiner() : windowSize(0) {}
+
+	/* Moves the count corners in place, each one searched in a (2 * windowSize + 1)
+	 * square window of the grey image. A corner moving more than windowSize away from
+	 * where it started is left where it was. */
+	void refine(const cv::Mat& grey, cv::Point2f* corners, int count, int windowSize);
+
+private:
+	void sampleWindow(const cv::Mat& grey, cv::Point2f center);
+
+	int                windowSize;
+	std::vector<float> weights; // Gaussian weights of the gradients in the window
+	std::vector<float> window;  // The window and a pixel around it, for the gradients
+};
+
 class Scanner {
 public:
 	cv::Mat greyImage;
 	cv::Mat binaryImage;
-	cv::Mat binaryInvertedImage;
-	cv::Mat labelImage;
-	cv::Mat labelInvertedImage;
+	/** With drawCodes set, the code area of the last marker found, see Marker::drawCode(). */
 	cv::Mat codeImage;
-	cv::Mat tmp; // Used for dilation and erosion
+	bool drawCodes;
+	/** Per-stage timings and counters, see trace.h. */
+	ScannerStats stats;
+	/** Size of the opening of the binary image, 0 to skip it. It applies to every region
+	 * scanned, the regions of the tracking mode included. */
+	int openingSize;
+	/** Tracking mode: only scan the regions where the markers of the previous frame are
+	 * expected, with a full scan every fullScanInterval frames or when a marker is lost. */
+	bool tracking;
+	int fullScanInterval;
+	/** Margin around the predicted markers, as a fraction of their size. */
+	float trackingMargin;
+	/** Coarse to fine mode: detect the markers on the frame downsampled pyramidLevels
+	 * times by 2, with a window as much smaller, then read them at full resolution. */
+	int pyramidLevels;
+	/** Tiled mode: with more than one thread, the threshold, the opening and the labeling
+	 * of a large region run in horizontal bands on a pool of threads, the markers found
+	 * are the same as with a single thread. */
+	int threads;
 
 	Scanner () {
-		// Nothing for now.
+		openingSize = 1;
+		tracking = false;
+		fullScanInterval = 30;
+		trackingMargin = 0.5;
+		pyramidLevels = 0;
+		threads = 1;
+		drawCodes = false;
+		framesSinceFullScan = 0;
+		greySharesFrame = false;
 	}
-	void findMarkers(cv::Mat& frame, int windowSize, int C, std::vector<marker::Marker*>& markers);
+	/** The markers found in the frame. They are kept by the Scanner and only valid until
+	 * the next call, the buffer is reused so that a frame needs no allocation once the
+	 * number of markers has been seen before. The frame is BGR, YUYV or grey, see
+	 * AdaptiveThreshold::apply(). */
+	const std::vector<marker::Marker>& findMarkers(cv::Mat& frame, int windowSize, int C);
+	/** The same for an 8 bits grey image in memory, width x height with stride bytes per
+	 * row, scanned in place: it is neither copied nor converted. The luma plane of an NV12
+	 * or I420 frame, as mono cameras and video decoders give it, is such an image, the
+	 * chroma planes are not needed. The image must stay valid until the next call. */
+	const std::vector<marker::Marker>& findMarkers(const uchar* grey, int width, int height, size_t stride,
+	                                               int windowSize, int C);
 
 	void findLabels(cv::Mat& image, cv::Mat& binary, int windowSize, int C);
 
-	void ccLabels(cv::Mat& binary, cv::Mat& label);
+	int ccLabels(cv::Mat& grey, int threshold, cv::Mat& labels);
+
+	/** Select the labeling kernels, see labelKernels(), and the threshold kernels of the
+	 * same instruction set, see thresholdKernels(). */
+	void setLabelKernels(const LabelKernels* kernels) {
+		labeler.setKernels(kernels);
+		thresholder.setKernels(thresholdKernels(kernels->name));
+	}
+
+private:
+	AdaptiveThreshold thresholder;
+	BinaryOpening opening;
+	Labeler labeler;
+	std::vector<marker::Marker> markers;
+	bool greySharesFrame; // greyImage is a header over the last frame, a grey one
+
+	/* Scratch buffers of the scan, kept from one frame to the next so that a frame does
+	 * not allocate once they have grown to the size of the frames and of the scenes. */
+	/* The components of the last labeling, one array per field so that the topology walk
+	 * only loads the fields it needs. Indexed by label, label 0 stands for the outside of
+	 * the region. The children of a component are linked through firstChild and
+	 * nextSibling, 0 ends the list. */
+	struct ComponentTable {
+		std::vector<int> area;            // Inside components only
+		std::vector<cv::Rect> bbox;       // Inside components only, frame coordinates
+		std::vector<cv::Point2f> center;  // Inside components only, frame coordinates
+		std::vector<int> parent;          // Written by the labeler
+		std::vector<int> childCount;      // Inside children
+		std::vector<int> totalChildCount; // Inside descendants
+		std::vector<int> firstChild;
+		std::vector<int> nextSibling;
+		std::vector<uint8_t> inside;      // Does not touch the sides of the region
+
+		void reset(int count) {
+			area.resize(count);
+			bbox.resize(count);
+			center.resize(count);
+			childCount.assign(count, 0);
+			totalChildCount.assign(count, 0);
+			firstChild.assign(count, 0);
+			nextSibling.assign(count, 0);
+			inside.assign(count, 0);
+		}
+	};
+	cv::Mat componentStats;
+	cv::Mat centroids;
+	ComponentTable components;
+	cv::Mat labelImage; // findLabels() only
+	CodeDecoder decoder;
+	std::vector<uint8_t> codewords;
+	std::vector<uint8_t> messages;
+	std::vector<CodeStatus> codeStatus;
+	CornerRefiner refiner;
+
+	/* A marker followed from frame to frame, in tracking mode. */
+	struct Track {
+		cv::Point2f center;
+		cv::Point2f velocity; // Pixels per frame
+		float       size;     // Length of the longest diagonal
+	};
+	std::vector<Track> tracks;
+	std::vector<Track> updatedTracks;
+	std::vector<cv::Rect> regions;
+	int framesSinceFullScan;
+
+	cv::Mat pyramidImage;
+	cv::Mat pyramidGreyImage;
+	cv::Mat pyramidBinaryImage;
+	std::vector<cv::Rect> candidates;
+
+	/* A band of the region in tiled mode, with its own threshold and opening buffers:
+	 * the bands are processed by different threads. The band is thresholded and opened
+	 * with the rows around it that these filters read, only its own rows are kept. */
+	struct Band {
+		AdaptiveThreshold thresholder;
+		BinaryOpening opening;
+		cv::Mat grey;
+		cv::Mat binary;
+	};
+	std::vector<Band> bands;
+	/* The arguments of labelBands() for the bands running on the pool. */
+	struct BandJob {
+		const cv::Mat* image;
+		cv::Mat* grey;
+		cv::Mat* binary;
+		int windowSize;
+		int C;
+		int count;
+		int overlap;
+		bool convert;
+	};
+	BandJob bandJob;
+	std::unique_ptr<WorkerPool> workers; // Created on the first tiled scan
+
+	void scanFrame(cv::Mat& frame, int windowSize, int C);
+	void scanPyramid(cv::Mat& frame, int windowSize, int C);
+	void scanRegion(cv::Mat& frame, const cv::Rect& region, cv::Mat& greyFrame, cv::Mat& binaryFrame,
+	                int windowSize, int C, std::vector<cv::Rect>* candidates);
+	int bandCount(const cv::Rect& region, int windowSize) const;
+	void labelBands(const cv::Mat& image, cv::Mat& grey, cv::Mat& binary, int windowSize, int C, int count);
+	void labelBand(int b);
+	void predictRegions(const cv::Rect& image, int windowSize);
+	void mergeRegions();
+	void decodeMarkers();
+	bool updateTracks(bool partial);
 };
 
 } /* End of namespace marker */
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "opening.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace marker {
+
+namespace {
+
+/* dst[x] = dst[x] & src[x] (all) or dst[x] | src[x], src may be dst shifted forward. */
+void combine(uchar* dst, const uchar* src, int width, bool all) {
+    int x = 0;
+#ifdef __SSE2__
+    for (; x <= width - 16; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + x));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + x));
+        _mm_storeu_si128((__m128i*)(dst + x), all ? _mm_and_si128(a, b) : _mm_or_si128(a, b));
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] = all ? (dst[x] & src[x]) : (dst[x] | src[x]);
+    }
+}
+
+/* row[x] = AND (or OR) of row[x .. x + window - 1] for x in [0, width). */
+void windowRow(uchar* row, int width, int window, bool all) {
+    int length = width + window - 1;
+    int span = 1;
+    for (; span * 2 <= window; span *= 2) {
+        combine(row, row + span, length - span, all);
+    }
+    // Two overlapping power of two spans cover the rest of the window.
+    if (span < window) {
+        combine(row, row + window - span, width, all);
+    }
+}
+
+/* counts[x] = set[x] ? counts[x] + 1 : 0, saturated. */
+void countSet(uchar* counts, const uchar* set, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; x <= width - 16; x += 16) {
+        __m128i clear = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(set + x)), zero);
+        __m128i c = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(counts + x)), one);
+        _mm_storeu_si128((__m128i*)(counts + x), _mm_andnot_si128(clear, c));
+    }
+#endif
+    for (; x < width; x++) {
+        counts[x] = set[x] ? (counts[x] < 255 ? counts[x] + 1 : 255) : 0;
+    }
+}
+
+/* counts[x] = set[x] ? 0 : counts[x] + 1, saturated. */
+void countClear(uchar* counts, const uchar* set, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; x <= width - 16; x += 16) {
+        __m128i clear = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(set + x)), zero);
+        __m128i c = _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(counts + x)), one);
+        _mm_storeu_si128((__m128i*)(counts + x), _mm_and_si128(clear, c));
+    }
+#endif
+    for (; x < width; x++) {
+        counts[x] = set[x] ? 0 : (counts[x] < 255 ? counts[x] + 1 : 255);
+    }
+}
+
+/* dst[x] = (counts[x] >= limit) == above ? 1 : 0 */
+void compareCounts(uchar* dst, const uchar* counts, int width, int limit, bool above) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i limits = _mm_set1_epi8((char)limit);
+    for (; x <= width - 16; x += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(counts + x));
+        __m128i reached = _mm_cmpeq_epi8(_mm_max_epu8(c, limits), c);
+        _mm_storeu_si128((__m128i*)(dst + x), above ? _mm_and_si128(reached, one) : _mm_andnot_si128(reached, one));
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] = (counts[x] >= limit) == above ? 1 : 0;
+    }
+}
+
+} /* End of anonymous namespace */
+
+void BinaryOpening::apply(cv::Mat& binary, int size) {
+    CV_Assert(binary.type() == CV_8UC1 && size >= 0 && size <= 127);
+    if (size == 0 || binary.empty()) {
+        return;
+    }
+    const int rows = binary.rows;
+    const int cols = binary.cols;
+    const int window = 2 * size + 1;
+
+    row.resize(cols + 2 * size);
+    // The pixels outside of the image are ignored: seen as set by the erosion and clear
+    // by the dilation.
+    eroded.assign(cols, 255);
+    dilated.assign(cols, 255);
+
+    for (int y = 0; y < rows + 2 * size; y++) {
+        // Row y, eroded horizontally, enters the column counts.
+        if (y < rows) {
+            memset(&row[0], 1, size);
+            memcpy(&row[size], binary.ptr<uchar>(y), cols);
+            memset(&row[size + cols], 1, size);
+            windowRow(&row[0], cols, window, true);
+        } else {
+            memset(&row[0], 1, cols);
+        }
+        countSet(&eroded[0], &row[0], cols);
+
+        // Row r of the eroded image is complete, dilated horizontally it enters the counts.
+        int r = y - size;
+        if (r < 0) {
+            continue;
+        }
+        if (r < rows) {
+            memset(&row[0], 0, size);
+            compareCounts(&row[size], &eroded[0], cols, window, true);
+            memset(&row[size + cols], 0, size);
+            windowRow(&row[0], cols, window, false);
+        } else {
+            memset(&row[0], 0, cols);
+        }
+        countClear(&dilated[0], &row[0], cols);
+
+        // Row o of the opened image is complete, rows up to y have already been read.
+        int o = r - size;
+        if (o >= 0) {
+            compareCounts(binary.ptr<uchar>(o), &dilated[0], cols, window, false);
+        }
+    }
+}
+
+} /* End of namespace marker */
@@ -0,0 +1,53 @@
+/*
+ * Morphological opening of binary images with square structuring elements.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_OPENING_H_
+#define SRC_OPENING_H_
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace marker {
+
+/* Erosion followed by dilation of a 0/1 image with a (2*size+1) x (2*size+1) square, as
+ * cv::erode and cv::dilate with a MORPH_RECT element and the default border would do,
+ * in place and in a single pass over the rows.
+ *
+ * On a binary image the minimum (maximum) of a row window is an AND (OR), computed by
+ * doubling the window in log2(2*size+1) steps. The column windows cost O(1) per pixel
+ * whatever the size: a pixel of the eroded image is set when the count of consecutive
+ * set pixels ending in its column reaches the window height, and a pixel of the opened
+ * image when the count of consecutive clear pixels is still below it. Each row is
+ * eroded as soon as its window is complete, then dilated, and written back once no
+ * later row needs the original pixels.
+ */
+class BinaryOpening {
+public:
+	/* Size 0 leaves the image as is, the size is at most 127. */
+	void apply(cv::Mat& binary, int size);
+
+private:
+	/* Scratch buffers, kept from one frame to the next. */
+	std::vector<uchar> row;     // One row padded by size on each side
+	std::vector<uchar> eroded;  // Consecutive set pixels in each column, after the row erosion
+	std::vector<uchar> dilated; // Consecutive clear pixels in each column, after the row dilation
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_OPENING_H_ */
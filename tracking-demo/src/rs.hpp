@@ -24,12 +24,17 @@ typedef unsigned uint;
 #define MSG_CNT 3   // необходимое количество полиномов длиной в сообщение
 #define POLY_CNT 14 // необходимое количество полиномов длиной в ecc_length * 2
 
+/* The polynomials of one Encode or Decode call and the memory they live in. A
+ * workspace is only used by one call at a time, ReedSolomon makes a new one for each
+ * call on the stack of the calling thread. */
 template <const uint8 msg_length,  // Длина сообщения без кода коррекции
           const uint8 ecc_length>  // Длина кода коррекции
 
-class ReedSolomon {
+class ReedSolomonWorkspace {
 public:
-    ReedSolomon() {
+    ReedSolomonWorkspace() {
+        memory = buffer;
+
         const uint8 enc_len  = msg_length + ecc_length;
         const uint8 poly_len = ecc_length * 2;
         uint  offset = 0;
@@ -58,11 +63,6 @@ public:
         }
     }
 
-    ~ReedSolomon() {
-        // Декструктор-пустышка, без него компилятор пытается освободить память на стеке через delete
-        memory = NULL;
-    }
-
     /* @brief Кодирование сообщения
      * @param *src - указатель на исходное сообщение             (размером msg_lenth)
      * @param *dst - буффер для записи закодированного сообщения (размером >= msg_length + ecc_length */
@@ -71,14 +71,6 @@ public:
         assert(msg_length + ecc_length < 256);
         #endif
 
-        /* Статический массив для кэширования генератора */
-        static uint8 generator[ecc_length+1] = {0};
-        static bool generator_cached = false;
-
-        /* Выделяем на стеке паямять для полиномов */
-        uint8 stack_memory[MSG_CNT * msg_length + POLY_CNT * ecc_length * 2];
-        this->memory = stack_memory;
-
         uint8 *src_ptr = (uint8*) src;
         uint8 *dst_ptr = (uint8*) dst;
 
@@ -91,14 +83,9 @@ public:
         msg_in.Reset();
         msg_out.Reset();
 
-        // Используем кэшированный генератор или генерируем новый
-        if(generator_cached) {
-            gen.Set(generator, sizeof(generator));
-        } else {
-            GeneratorPoly();
-            memcpy(generator, gen.ptr(), gen.length);
-            generator_cached = true;
-        }
+        // The generator is computed again by each call: a cache shared by all the
+        // calls would need synchronization.
+        GeneratorPoly();
 
         // Копируем сообщение в полиномы
         msg_in.Set(src_ptr, msg_length);
@@ -140,10 +127,6 @@ public:
         const uint src_len = msg_length + ecc_length;
         const uint dst_len = msg_length;
 
-        /* Выделяем на стеке паямять для полиномов */
-        uint8 stack_memory[MSG_CNT * msg_length + POLY_CNT * ecc_length * 2];
-        this->memory = stack_memory;
-
         Poly &msg_in  = polynoms[ID_MSG_IN];
         Poly &msg_out = polynoms[ID_MSG_OUT];
         Poly &epos    = polynoms[ID_ERASURES];
@@ -245,10 +228,16 @@ private:
         ID_ERR_EVAL,
     };
 
-    // Указатель на массив на стеке вызванного метода
+    /* The polynomials are laid out in buffer: 3 of the codeword length and 13 of twice
+     * the ECC length. The Poly objects point to memory, which points to buffer, so a
+     * workspace cannot be copied. */
+    uint8 buffer[MSG_CNT * (msg_length + ecc_length) + POLY_CNT * ecc_length * 2];
     uint8* memory;
     Poly polynoms[MSG_CNT + POLY_CNT];
 
+    ReedSolomonWorkspace(const ReedSolomonWorkspace&);
+    ReedSolomonWorkspace& operator=(const ReedSolomonWorkspace&);
+
     #ifdef DEBUG
     const uint8 msg_len = msg_length;
     const uint8 ecc_len = ecc_length;
@@ -508,6 +497,24 @@ private:
     }
 };
 
+/* Reentrant: an instance has no state, the polynomials of each call are in a
+ * workspace of its own and the GF tables are constants. The same instance can be used
+ * by any number of threads at the same time. */
+template <const uint8 msg_length,
+          const uint8 ecc_length>
+class ReedSolomon {
+public:
+    void Encode(void* src, void* dst) const {
+        ReedSolomonWorkspace<msg_length, ecc_length> workspace;
+        workspace.Encode(src, dst);
+    }
+
+    int Decode(void* src, void* dst, uint8* erase_pos = nullptr, size_t erase_count = 0) const {
+        ReedSolomonWorkspace<msg_length, ecc_length> workspace;
+        return workspace.Decode(src, dst, erase_pos, erase_count);
+    }
+};
+
 }
 
 #endif // RS_HPP
@@ -0,0 +1,98 @@
+/*
+ * Bounded lock-free queue between one producer and one consumer thread.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_SPSC_H_
+#define SRC_SPSC_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace marker {
+
+/* Ring of capacity slots, the capacity is rounded up to a power of two. The producer
+ * only writes tail and the consumer only writes head, each index is published with a
+ * release store and read with an acquire load by the other side, so that the slot
+ * contents are visible before the index that hands them over.
+ *
+ * Neither side ever waits: push() fails when the ring is full and pop() when it is
+ * empty, the caller decides whether to drop, retry or sleep. The items are copied in
+ * and out, a popped slot is reset to T() so that it does not keep a reference to the
+ * item (e.g. the pixels of a cv::Mat) until it is overwritten.
+ */
+template <typename T>
+class SpscQueue {
+public:
+	explicit SpscQueue(size_t capacity) : head(0), tail(0) {
+		size_t size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	/* Producer side. */
+	bool push(const T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask) {
+			return false;
+		}
+		slots[t & mask] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Consumer side. */
+	bool pop(T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = slots[h & mask];
+		slots[h & mask] = T();
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Either side, only a hint while the other side is running. */
+	size_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+
+private:
+	SpscQueue(const SpscQueue&);
+	SpscQueue& operator=(const SpscQueue&);
+
+	std::vector<T> slots;
+	size_t mask;
+	/* Padded apart, each is written by one side only and should not share its cache
+	 * line with the other (alignas would need the C++17 aligned new). */
+	char padding0[64];
+	std::atomic<size_t> head;
+	char padding1[64];
+	std::atomic<size_t> tail;
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_SPSC_H_ */
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "synth.h"
+#include <opencv2/imgproc.hpp>
+#include <cmath>
+#include "rs.hpp"
+
+namespace marker {
+
+namespace {
+
+/* Number of fractional bits used when drawing, to keep the sub-pixel geometry. */
+const int SHIFT = 4;
+
+/* Draws in SVG units on an image with a given number of pixels per unit. */
+class Canvas {
+public:
+	Canvas(cv::Mat& image, double scale) : image(image), scale(scale * (1 << SHIFT)) {}
+
+	void disc(double x, double y, double r, int color) {
+		cv::circle(image, point(x, y), cvRound(r * scale), cv::Scalar(color), cv::FILLED, cv::LINE_AA, SHIFT);
+	}
+
+	void box(double x0, double y0, double x1, double y1, int color) {
+		cv::Point corners[4] = { point(x0, y0), point(x1, y0), point(x1, y1), point(x0, y1) };
+		cv::fillConvexPoly(image, corners, 4, cv::Scalar(color), cv::LINE_AA, SHIFT);
+	}
+
+	/* SVG stroke of width w along an horizontal or vertical segment, with butt caps. */
+	void stroke(double x0, double y0, double x1, double y1, double w) {
+		if (x0 == x1) {
+			box(x0 - w/2, std::min(y0, y1), x0 + w/2, y0 < y1 ? y1 : y0, 0);
+		} else {
+			box(std::min(x0, x1), y0 - w/2, x0 < x1 ? x1 : x0, y0 + w/2, 0);
+		}
+	}
+
+	/* Circle of radius r drawn with a stroke of width w. */
+	void ring(double x, double y, double r, double w) {
+		disc(x, y, r + w/2, 0);
+		disc(x, y, r - w/2, 255);
+	}
+
+	/* Outline of a capsule: two half circles of radius r joined by straight lines. */
+	void capsule(double x1, double y1, double x2, double y2, double r, double w) {
+		for (int pass = 0; pass < 2; pass++) {
+			double radius = pass == 0 ? r + w/2 : r - w/2;
+			int color = pass == 0 ? 0 : 255;
+			disc(x1, y1, radius, color);
+			disc(x2, y2, radius, color);
+			if (x1 == x2) {
+				box(x1 - radius, std::min(y1, y2), x1 + radius, y1 < y2 ? y2 : y1, color);
+			} else {
+				box(std::min(x1, x2), y1 - radius, x1 < x2 ? x2 : x1, y1 + radius, color);
+			}
+		}
+	}
+
+private:
+	cv::Point point(double x, double y) const {
+		return cv::Point(cvRound(x * scale), cvRound(y * scale));
+	}
+
+	cv::Mat& image;
+	double   scale;
+};
+
+cv::Point2f transform(const cv::Matx33d& h, const cv::Point2f& p) {
+	double w = h(2,0)*p.x + h(2,1)*p.y + h(2,2);
+	return cv::Point2f((h(0,0)*p.x + h(0,1)*p.y + h(0,2))/w, (h(1,0)*p.x + h(1,1)*p.y + h(1,2))/w);
+}
+
+} /* End of anonymous namespace */
+
+MarkerArtwork::MarkerArtwork(int size) : size(size), margin(50) {
+}
+
+/* The arithmetic below follows mkPattern.py, which uses integer divisions. */
+
+cv::Size2f MarkerArtwork::extent() const {
+	int ymax = 1000-margin-(size*5)/2 + 1000-2*(margin+(size*5)/2);
+	return cv::Size2f(1000, ymax + margin);
+}
+
+cv::Point2f MarkerArtwork::zero() const {
+	return cv::Point2f(margin+(size*5)/2, 1000-margin-(size*5)/2);
+}
+
+cv::Point2f MarkerArtwork::one() const {
+	return cv::Point2f(margin+(size*5)/2, margin+(size*5)/2);
+}
+
+cv::Point2f MarkerArtwork::two() const {
+	return cv::Point2f(1000-margin-(size*5)/2, margin+(size*5)/2);
+}
+
+cv::Point2f MarkerArtwork::three() const {
+	return cv::Point2f(1000-margin-(size*5)/2, 1000-margin-(size*5)/2);
+}
+
+void MarkerArtwork::codeCorners(cv::Point2f corners[4]) const {
+	/* See the construction in Marker::normalize(): the code area lies below the
+	 * square made of the four corner dots, between half a side and a side away. */
+	float side = three().x - zero().x;
+	corners[0] = cv::Point2f(zero().x, zero().y + side);
+	corners[1] = cv::Point2f(zero().x, zero().y + side/2);
+	corners[2] = cv::Point2f(three().x, three().y + side/2);
+	corners[3] = cv::Point2f(three().x, three().y + side);
+}
+
+void MarkerArtwork::render(const uint8_t code[4], double scale, cv::Mat& image) const {
+	cv::Size2f sheetSize = extent();
+	image.create(cvCeil(sheetSize.height * scale), cvCeil(sheetSize.width * scale), CV_8UC1);
+	image.setTo(cv::Scalar(255));
+
+	Canvas canvas(image, scale);
+	int s = this->size, m = margin;
+	int dot = (s*2)/3;
+
+	// Zero: an empty circle.
+	canvas.ring(m+(s*5)/2, 1000-m-(s*5)/2, s, s);
+	canvas.stroke(m+(s*5)/2, 1000-m-(s*7)/2, m+(s*5)/2, m+(s*9)/2, s);
+	// One: a circle around one dot.
+	canvas.ring(m+(s*5)/2, m+(s*5)/2, s*2, s);
+	canvas.disc(m+(s*5)/2, m+(s*5)/2, dot, 0);
+	canvas.stroke(m+(s*9)/2, m+(s*5)/2, 1000-m-(s*9)/2, m+(s*5)/2, s);
+	// Two: a vertical capsule around two dots.
+	int x = 1000-m-(s*5)/2;
+	canvas.capsule(x, m+(s*5)/2, x, m+(s*9)/2, s*2, s);
+	canvas.disc(x, m+(s*5)/2, dot, 0);
+	canvas.disc(x, m+(s*9)/2, dot, 0);
+	canvas.stroke(x, m+(s*13)/2, x, 1000-m-(s*9)/2, s);
+	// Three: an horizontal capsule around three dots.
+	int y = 1000-m-(s*5)/2;
+	canvas.capsule(x, y, x-s*4, y, s*2, s);
+	canvas.disc(x, y, dot, 0);
+	canvas.disc(x-s*2, y, dot, 0);
+	canvas.disc(x-s*4, y, dot, 0);
+	canvas.stroke(m+(s*7)/2, y, 1000-m-(s*17)/2, y, s);
+
+	// The code, framed by "[" and "]" signs.
+	int ymax = 1000-m-(s*5)/2 + 1000-2*(m+(s*5)/2);
+	int ymin = 1000-m-(s*5)/2 + (1000-2*(m+(s*5)/2))/2;
+	for (int side = 0; side < 2; side++) {
+		double outer = side == 0 ? m+s/2 : 1000-m-s/2;
+		double inner = side == 0 ? m+(4*s)/2 : 1000-m-(4*s)/2;
+		double joint = side == 0 ? inner + s/2 : inner - s/2;
+		canvas.stroke(outer, ymin+s/2, joint, ymin+s/2, s);
+		canvas.stroke(inner, ymin, inner, ymax, s);
+		canvas.stroke(outer, ymax-s/2, joint, ymax-s/2, s);
+	}
+
+	uint8_t encoded[10];
+	RS::ReedSolomon<4 /* Message length */, 6 /* ECC length */> rs;
+	rs.Encode((void*)code, encoded);
+
+	int topLeftx = m+(7*s)/2;
+	int bottomRightx = 1000-m-(7*s)/2;
+	int cellWidth = (bottomRightx - topLeftx)/10;
+	int cellHeight = (ymax - ymin)/8;
+	for (int bx = 0; bx < 10; bx++) {
+		for (int by = 0; by < 8; by++) {
+			if ((encoded[bx] >> by) & 0x1) {
+				double startX = topLeftx + bx*cellWidth;
+				double startY = ymin + ((2*by+1)*cellHeight)/2;
+				canvas.stroke(startX, startY, startX + cellWidth, startY, cellHeight);
+			}
+		}
+	}
+}
+
+SceneGenerator::SceneGenerator(const SceneOptions& options)
+	: options(options), artwork(options.stroke) {
+}
+
+void SceneGenerator::generate(int index, cv::Mat& image, std::vector<GroundTruthMarker>& truth) {
+	cv::RNG rng(options.seed * 1000003ULL + (uint64_t)index);
+	cv::Size size = options.imageSize;
+	cv::Mat grey(size, CV_8UC1, cv::Scalar(rng.uniform(90, 200)));
+	int maxShape = std::min(size.width, size.height) / 8 + 2;
+
+	truth.clear();
+
+	// Background clutter, which produces plenty of connected components.
+	for (int i = 0; i < options.clutter; i++) {
+		cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		int extent = rng.uniform(2, maxShape);
+		cv::Scalar color(rng.uniform(0, 256));
+		if (rng.uniform(0, 2) == 0) {
+			cv::circle(grey, center, extent, color, rng.uniform(0, 2) ? cv::FILLED : 1 + extent/8);
+		} else {
+			cv::rectangle(grey, center, center + cv::Point(extent, rng.uniform(2, maxShape)), color,
+			              rng.uniform(0, 2) ? cv::FILLED : 1 + extent/8);
+		}
+	}
+
+	// Place the markers, avoiding any overlap between them.
+	cv::Size2f sheetSize = artwork.extent();
+	cv::Point2f sheetCenter(sheetSize.width/2, sheetSize.height/2);
+	double unitSide = artwork.three().x - artwork.zero().x;
+	double focal = size.width;
+	std::vector<cv::Rect> placed;
+
+	for (int i = 0; i < options.markerCount; i++) {
+		for (int attempt = 0; attempt < 50; attempt++) {
+			double side = rng.uniform(options.minSide, options.maxSide);
+			double k = side / unitSide;
+			double rz = rng.uniform(0.0, 2*CV_PI);
+			double rx = rng.uniform(-options.maxTilt, options.maxTilt) * CV_PI / 180;
+			double ry = rng.uniform(-options.maxTilt, options.maxTilt) * CV_PI / 180;
+			cv::Matx33d Rz(std::cos(rz), -std::sin(rz), 0, std::sin(rz), std::cos(rz), 0, 0, 0, 1);
+			cv::Matx33d Rx(1, 0, 0, 0, std::cos(rx), -std::sin(rx), 0, std::sin(rx), std::cos(rx));
+			cv::Matx33d Ry(std::cos(ry), 0, std::sin(ry), 0, 1, 0, -std::sin(ry), 0, std::cos(ry));
+			cv::Matx33d R = Rx * Ry * Rz;
+			cv::Point2f position(rng.uniform(0.0, (double)size.width), rng.uniform(0.0, (double)size.height));
+
+			// Project the corners of the sheet with a pinhole camera looking at it.
+			cv::Point2f sheetCorners[4] = {
+				cv::Point2f(0, 0), cv::Point2f(sheetSize.width, 0),
+				cv::Point2f(sheetSize.width, sheetSize.height), cv::Point2f(0, sheetSize.height)
+			};
+			cv::Point2f imageCorners[4];
+			bool visible = true;
+			for (int c = 0; c < 4; c++) {
+				cv::Vec3d p = R * cv::Vec3d(k*(sheetCorners[c].x - sheetCenter.x), k*(sheetCorners[c].y - sheetCenter.y), 0);
+				double z = p[2] + focal;
+				if (z < focal / 4) {
+					visible = false;
+					break;
+				}
+				imageCorners[c] = cv::Point2f(focal*p[0]/z + position.x, focal*p[1]/z + position.y);
+			}
+			if (!visible) {
+				continue;
+			}
+			cv::Rect bounds = cv::boundingRect(std::vector<cv::Point2f>(imageCorners, imageCorners + 4));
+			if ((bounds & cv::Rect(2, 2, size.width - 4, size.height - 4)) != bounds) {
+				continue;
+			}
+			bool overlaps = false;
+			for (size_t j = 0; j < placed.size(); j++) {
+				if ((bounds & placed[j]).area() > 0) {
+					overlaps = true;
+				}
+			}
+			if (overlaps) {
+				continue;
+			}
+
+			GroundTruthMarker marker;
+			for (int b = 0; b < 4; b++) {
+				marker.code[b] = options.fixedCode ? options.code[b] : (uint8_t)rng.uniform(0, 256);
+			}
+
+			// Render the sheet at about twice the final resolution, then warp it into the scene.
+			double scale = std::min(1.0, 2*k < 0.05 ? 0.05 : 2*k);
+			artwork.render(marker.code, scale, sheet);
+			cv::Point2f sheetPixels[4];
+			for (int c = 0; c < 4; c++) {
+				sheetPixels[c] = sheetCorners[c] * scale;
+			}
+			cv::Matx33d h = cv::getPerspectiveTransform(sheetPixels, imageCorners);
+			cv::warpPerspective(sheet, grey, h, size, cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+
+			// Map the reference points from SVG units to the image.
+			cv::Matx33d toImage = h * cv::Matx33d(scale, 0, 0, 0, scale, 0, 0, 0, 1);
+			cv::Point2f codeCorners[4];
+			artwork.codeCorners(codeCorners);
+			marker.zero   = transform(toImage, artwork.zero());
+			marker.one    = transform(toImage, artwork.one());
+			marker.two    = transform(toImage, artwork.two());
+			marker.three  = transform(toImage, artwork.three());
+			marker.center = transform(toImage, (artwork.zero() + artwork.two()) * 0.5);
+			for (int c = 0; c < 4; c++) {
+				marker.codeCorners[c] = transform(toImage, codeCorners[c]);
+			}
+			marker.side = side;
+			truth.push_back(marker);
+			placed.push_back(bounds);
+			break;
+		}
+	}
+
+	// Imaging defects: blur, uneven lighting and sensor noise.
+	cv::Mat work;
+	grey.convertTo(work, CV_32F);
+	double sigma = rng.uniform(0.0, options.maxBlur);
+	if (sigma > 0.1) {
+		cv::GaussianBlur(work, work, cv::Size(0, 0), sigma);
+	}
+	if (options.gradient > 0) {
+		double angle = rng.uniform(0.0, 2*CV_PI);
+		double dx = std::cos(angle), dy = std::sin(angle);
+		double halfDiagonal = std::sqrt((double)size.width*size.width + (double)size.height*size.height) / 2;
+		for (int row = 0; row < size.height; row++) {
+			float* p = work.ptr<float>(row);
+			for (int col = 0; col < size.width; col++) {
+				double t = ((col - size.width/2)*dx + (row - size.height/2)*dy) / halfDiagonal;
+				p[col] *= (float)(1.0 - options.gradient * (t + 1) / 2);
+			}
+		}
+	}
+	if (options.noise > 0) {
+		cv::Mat noise(size, CV_32F);
+		rng.fill(noise, cv::RNG::NORMAL, cv::Scalar(0), cv::Scalar(options.noise));
+		work += noise;
+	}
+	work.convertTo(grey, CV_8U);
+	cv::cvtColor(grey, image, cv::COLOR_GRAY2BGR);
+}
+
+std::string groundTruthPath(const std::string& imagePath) {
+	size_t dot = imagePath.find_last_of('.');
+	size_t slash = imagePath.find_last_of('/');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+		return imagePath + ".yml";
+	}
+	return imagePath.substr(0, dot) + ".yml";
+}
+
+bool writeGroundTruth(const std::string& path, cv::Size imageSize, const std::vector<GroundTruthMarker>& truth) {
+	cv::FileStorage fs(path, cv::FileStorage::WRITE);
+	if (!fs.isOpened()) {
+		return false;
+	}
+	fs << "width" << imageSize.width;
+	fs << "height" << imageSize.height;
+	fs << "markers" << "[";
+	for (size_t i = 0; i < truth.size(); i++) {
+		const GroundTruthMarker& marker = truth[i];
+		fs << "{";
+		fs << "code" << std::vector<int>(marker.code, marker.code + 4);
+		fs << "side" << marker.side;
+		fs << "center" << marker.center;
+		fs << "zero" << marker.zero;
+		fs << "one" << marker.one;
+		fs << "two" << marker.two;
+		fs << "three" << marker.three;
+		fs << "codeCorners" << std::vector<cv::Point2f>(marker.codeCorners, marker.codeCorners + 4);
+		fs << "}";
+	}
+	fs << "]";
+	return true;
+}
+
+bool readGroundTruth(const std::string& path, std::vector<GroundTruthMarker>& truth) {
+	cv::FileStorage fs(path, cv::FileStorage::READ);
+	truth.clear();
+	if (!fs.isOpened()) {
+		return false;
+	}
+	cv::FileNode markers = fs["markers"];
+	for (size_t i = 0; i < markers.size(); i++) {
+		cv::FileNode node = markers[(int)i];
+		GroundTruthMarker marker;
+		std::vector<int> code;
+		std::vector<cv::Point2f> codeCorners;
+		node["code"] >> code;
+		node["side"] >> marker.side;
+		node["center"] >> marker.center;
+		node["zero"] >> marker.zero;
+		node["one"] >> marker.one;
+		node["two"] >> marker.two;
+		node["three"] >> marker.three;
+		node["codeCorners"] >> codeCorners;
+		if (code.size() != 4 || codeCorners.size() != 4) {
+			return false;
+		}
+		for (int j = 0; j < 4; j++) {
+			marker.code[j] = (uint8_t)code[j];
+			marker.codeCorners[j] = codeCorners[j];
+		}
+		truth.push_back(marker);
+	}
+	return true;
+}
+
+} /* End of namespace marker */
@@ -0,0 +1,117 @@
+/*
+ * Synthetic scenes of coded markers, used to benchmark the scanner without a
+ * camera.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_SYNTH_H_
+#define SRC_SYNTH_H_
+
+#include <opencv2/core.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace marker {
+
+/* The coded marker drawn by marker-design/mkPattern.py.
+ *
+ * All the coordinates are expressed in the units of the SVG document, which is
+ * 1000 units wide. The size parameter is the stroke width used by the script.
+ */
+class MarkerArtwork {
+public:
+	explicit MarkerArtwork(int size = 72);
+
+	/* Size of the sheet of paper holding the marker and its code. */
+	cv::Size2f extent() const;
+
+	/* Centers of the dots used as corners by the scanner, see Marker::normalize(). */
+	cv::Point2f zero() const;
+	cv::Point2f one() const;
+	cv::Point2f two() const;
+	cv::Point2f three() const;
+
+	/* Corners of the code area, in the order used by Marker::codeCorners. */
+	void codeCorners(cv::Point2f corners[4]) const;
+
+	/* Render the marker and its Reed-Solomon protected 4 byte code in black on a
+	 * white CV_8UC1 image, with scale pixels per SVG unit. */
+	void render(const uint8_t code[4], double scale, cv::Mat& image) const;
+
+private:
+	int size;
+	int margin;
+};
+
+/* Parameters of the generated scenes. Distances are in pixels, angles in degrees. */
+struct SceneOptions {
+	cv::Size imageSize;
+	int      markerCount;
+	int      stroke;          // Stroke size of the marker, as in mkPattern.py
+	double   minSide;         // Distance between the zero and three dots
+	double   maxSide;
+	double   maxTilt;         // Out of plane rotation
+	double   maxBlur;         // Gaussian blur sigma
+	double   noise;           // Gaussian noise sigma, in grey levels
+	double   gradient;        // Lighting fall-off across the image, from 0 to 1
+	int      clutter;         // Number of random shapes in the background
+	bool     fixedCode;
+	uint8_t  code[4];         // Used for every marker when fixedCode is set
+	uint64_t seed;
+
+	SceneOptions()
+		: imageSize(1920, 1080), markerCount(4), stroke(72), minSide(60), maxSide(300),
+		  maxTilt(40), maxBlur(1.0), noise(4.0), gradient(0.3), clutter(40),
+		  fixedCode(false), seed(1) {
+		code[0] = 5; code[1] = 1; code[2] = 9; code[3] = 4;
+	}
+};
+
+/* Where a marker was placed in a generated scene, in image coordinates. */
+struct GroundTruthMarker {
+	uint8_t     code[4];
+	cv::Point2f center;
+	cv::Point2f zero;
+	cv::Point2f one;
+	cv::Point2f two;
+	cv::Point2f three;
+	cv::Point2f codeCorners[4];
+	double      side;
+};
+
+/* Deterministic generator: scene number n only depends on the options and n. */
+class SceneGenerator {
+public:
+	explicit SceneGenerator(const SceneOptions& options);
+
+	/* Render scene number index as a BGR image. */
+	void generate(int index, cv::Mat& image, std::vector<GroundTruthMarker>& truth);
+
+private:
+	SceneOptions  options;
+	MarkerArtwork artwork;
+	cv::Mat       sheet;
+};
+
+/* Ground truth files are stored next to the images with the .yml extension. */
+std::string groundTruthPath(const std::string& imagePath);
+bool writeGroundTruth(const std::string& path, cv::Size imageSize, const std::vector<GroundTruthMarker>& truth);
+bool readGroundTruth(const std::string& path, std::vector<GroundTruthMarker>& truth);
+
+} /* End of namespace marker */
+
+#endif /* SRC_SYNTH_H_ */
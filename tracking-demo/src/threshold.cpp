@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "threshold.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The SSE2 and AVX2 kernels of the window are compiled for their own target and only
+ * selected when the CPU running the program supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define THRESHOLD_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace marker {
+
+namespace {
+
+// Fixed point coefficients used by cv::cvtColor
+const int GREY_SHIFT = 14;
+const int GREY_B = 1868;
+const int GREY_G = 9617;
+const int GREY_R = 4899;
+
+inline int clampRow(int y, int rows) {
+    return y < 0 ? 0 : (y >= rows ? rows - 1 : y);
+}
+
+#ifdef __SSE2__
+/* Grey value of the 4 pixels at p, as 32 bits integers. Reads 16 bytes. */
+inline __m128i greyFour(const uchar* p) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coefficients = _mm_setr_epi16(GREY_B, GREY_G, GREY_R, 0, GREY_B, GREY_G, GREY_R, 0);
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    // One pixel in each 32 bits lane, the fourth byte is ignored.
+    v = _mm_unpacklo_epi64(_mm_unpacklo_epi32(v, _mm_srli_si128(v, 3)),
+                           _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9)));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), coefficients);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), coefficients);
+    // Add b*B + g*G and r*R of each pixel.
+    __m128 a = _mm_castsi128_ps(lo), b = _mm_castsi128_ps(hi);
+    __m128i sum = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))),
+                                _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+    sum = _mm_add_epi32(sum, _mm_set1_epi32(1 << (GREY_SHIFT - 1)));
+    return _mm_srli_epi32(sum, GREY_SHIFT);
+}
+#endif
+
+/* prefix[0] = 0, prefix[i + 1] = prefix[i] + sums[i] */
+void prefixSums(const int* sums, int* prefix, int n) {
+    int i = 0, total = 0;
+    prefix[0] = 0;
+#ifdef __SSE2__
+    __m128i carry = _mm_setzero_si128();
+    for (; i <= n - 4; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(sums + i));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, carry);
+        _mm_storeu_si128((__m128i*)(prefix + i + 1), v);
+        carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    total = _mm_cvtsi128_si32(carry);
+#endif
+    for (; i < n; i++) {
+        total += sums[i];
+        prefix[i + 1] = total;
+    }
+}
+
+/* sums[x] += add[x] - sub[x] */
+void updateColumnsScalar(int* sums, const uchar* add, const uchar* sub, int width) {
+    for (int x = 0; x < width; x++) {
+        sums[x] += add[x] - sub[x];
+    }
+}
+
+/* The mean is round(box / area), and src - mean > -delta is the same as
+ * box + area / 2 < (src + delta) * area, which needs no division. */
+void thresholdRowScalar(const int* prefix, const uchar* src, uchar* dst, int width, int windowSize, int delta) {
+    const int area = windowSize * windowSize;
+    const int half = area / 2;
+    const int* left = prefix;
+    const int* right = prefix + windowSize;
+    for (int x = 0; x < width; x++) {
+        int box = right[x] - left[x];
+        dst[x] = (int64_t)box + half < (int64_t)(src[x] + delta) * area ? 1 : 0;
+    }
+}
+
+#ifdef THRESHOLD_KERNELS_X86
+
+__attribute__((target("sse2")))
+void updateColumnsSSE2(int* sums, const uchar* add, const uchar* sub, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x <= width - 16; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(add + x));
+        __m128i s = _mm_loadu_si128((const __m128i*)(sub + x));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(s, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(s, zero));
+        // Sign extension to 32 bits
+        __m128i d[4] = {
+            _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16),
+            _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16),
+            _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16),
+            _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16),
+        };
+        __m128i* p = (__m128i*)(sums + x);
+        for (int i = 0; i < 4; i++) {
+            _mm_storeu_si128(p + i, _mm_add_epi32(_mm_loadu_si128(p + i), d[i]));
+        }
+    }
+    updateColumnsScalar(sums + x, add + x, sub + x, width - x);
+}
+
+__attribute__((target("sse2")))
+void thresholdRowSSE2(const int* prefix, const uchar* src, uchar* dst, int width, int windowSize, int delta) {
+    const int area = windowSize * windowSize;
+    const int half = area / 2;
+    const int* left = prefix;
+    const int* right = prefix + windowSize;
+    int x = 0;
+    // The 16 bits products are exact as long as the area fits in 15 bits.
+    if (area <= 32767) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i delta16 = _mm_set1_epi16((short)delta);
+        const __m128i area16 = _mm_set1_epi16((short)area);
+        const __m128i half32 = _mm_set1_epi32(half);
+        for (; x <= width - 16; x += 16) {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(src + x));
+            __m128i t[2] = {
+                _mm_add_epi16(_mm_unpacklo_epi8(pixels, zero), delta16),
+                _mm_add_epi16(_mm_unpackhi_epi8(pixels, zero), delta16),
+            };
+            __m128i m[4];
+            for (int i = 0; i < 4; i++) {
+                __m128i lo = _mm_mullo_epi16(t[i / 2], area16);
+                __m128i hi = _mm_mulhi_epi16(t[i / 2], area16);
+                __m128i limit = (i % 2) ? _mm_unpackhi_epi16(lo, hi) : _mm_unpacklo_epi16(lo, hi);
+                __m128i box = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(right + x + 4 * i)),
+                                            _mm_loadu_si128((const __m128i*)(left + x + 4 * i)));
+                m[i] = _mm_cmplt_epi32(_mm_add_epi32(box, half32), limit);
+            }
+            __m128i mask = _mm_packs_epi16(_mm_packs_epi32(m[0], m[1]), _mm_packs_epi32(m[2], m[3]));
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_and_si128(mask, _mm_set1_epi8(1)));
+        }
+    }
+    thresholdRowScalar(prefix + x, src + x, dst + x, width - x, windowSize, delta);
+}
+
+__attribute__((target("avx2")))
+void updateColumnsAVX2(int* sums, const uchar* add, const uchar* sub, int width) {
+    int x = 0;
+    for (; x <= width - 16; x += 16) {
+        __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(add + x)));
+        __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(sub + x)));
+        __m256i d = _mm256_sub_epi16(a, s);
+        __m256i* p = (__m256i*)(sums + x);
+        _mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p), _mm256_cvtepi16_epi32(_mm256_castsi256_si128(d))));
+        _mm256_storeu_si256(p + 1, _mm256_add_epi32(_mm256_loadu_si256(p + 1), _mm256_cvtepi16_epi32(_mm256_extracti128_si256(d, 1))));
+    }
+    updateColumnsScalar(sums + x, add + x, sub + x, width - x);
+}
+
+__attribute__((target("avx2")))
+void thresholdRowAVX2(const int* prefix, const uchar* src, uchar* dst, int width, int windowSize, int delta) {
+    const int area = windowSize * windowSize;
+    const int* left = prefix;
+    const int* right = prefix + windowSize;
+    const __m256i delta32 = _mm256_set1_epi32(delta);
+    const __m256i area32 = _mm256_set1_epi32(area);
+    const __m256i half32 = _mm256_set1_epi32(area / 2);
+    int x = 0;
+    for (; x <= width - 16; x += 16) {
+        __m256i m[2];
+        for (int i = 0; i < 2; i++) {
+            __m256i pixels = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x + 8 * i)));
+            __m256i limit = _mm256_mullo_epi32(_mm256_add_epi32(pixels, delta32), area32);
+            __m256i box = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(right + x + 8 * i)),
+                                           _mm256_loadu_si256((const __m256i*)(left + x + 8 * i)));
+            m[i] = _mm256_cmpgt_epi32(limit, _mm256_add_epi32(box, half32));
+        }
+        // The packs work on each 128 bits lane, put the pixels back in order.
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(m[0], m[1]), _MM_SHUFFLE(3, 1, 2, 0));
+        packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(packed, packed), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_and_si128(_mm256_castsi256_si128(packed), _mm_set1_epi8(1)));
+    }
+    thresholdRowScalar(prefix + x, src + x, dst + x, width - x, windowSize, delta);
+}
+
+#endif /* THRESHOLD_KERNELS_X86 */
+
+const ThresholdKernels scalarKernels = { "scalar", updateColumnsScalar, thresholdRowScalar };
+#ifdef THRESHOLD_KERNELS_X86
+const ThresholdKernels sse2Kernels = { "sse2", updateColumnsSSE2, thresholdRowSSE2 };
+const ThresholdKernels avx2Kernels = { "avx2", updateColumnsAVX2, thresholdRowAVX2 };
+#endif
+
+/* Fixed point BGR to grey conversion of one row, as done by cv::cvtColor. */
+void greyRow(const uchar* bgr, uchar* grey, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    // The second group of 4 pixels reads 16 bytes from pixel x + 4, stay in the row.
+    for (; x <= width - 10; x += 8) {
+        __m128i g = _mm_packs_epi32(greyFour(bgr + 3 * x), greyFour(bgr + 3 * x + 12));
+        _mm_storel_epi64((__m128i*)(grey + x), _mm_packus_epi16(g, g));
+    }
+#endif
+    for (; x < width; x++) {
+        const uchar* p = bgr + 3 * x;
+        grey[x] = (uchar)((p[0] * GREY_B + p[1] * GREY_G + p[2] * GREY_R + (1 << (GREY_SHIFT - 1))) >> GREY_SHIFT);
+    }
+}
+
+/* Luma of one row of YUYV (Y0 U Y1 V) pixels, the even bytes. */
+void lumaRow(const uchar* yuyv, uchar* grey, int width) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    for (; x <= width - 16; x += 16) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(yuyv + 2 * x)), mask);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(yuyv + 2 * x + 16)), mask);
+        _mm_storeu_si128((__m128i*)(grey + x), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; x < width; x++) {
+        grey[x] = yuyv[2 * x];
+    }
+}
+
+/* Grey row of a BGR (3 channels) or YUYV (2 channels) row. */
+inline void convertRow(const uchar* src, uchar* grey, int width, int channels) {
+    if (channels == 3) {
+        greyRow(src, grey, width);
+    } else {
+        lumaRow(src, grey, width);
+    }
+}
+
+} /* End of anonymous namespace */
+
+const ThresholdKernels* thresholdKernels(const char* isa) {
+    bool best = isa == NULL || strcmp(isa, "auto") == 0;
+#ifdef THRESHOLD_KERNELS_X86
+    __builtin_cpu_init();
+    // No AVX-512 kernels, the AVX2 ones are used instead.
+    if ((best || strcmp(isa, "avx2") == 0 || strcmp(isa, "avx512") == 0) && __builtin_cpu_supports("avx2")) {
+        return &avx2Kernels;
+    }
+    if ((best || strcmp(isa, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        return &sse2Kernels;
+    }
+#endif
+    if (best || strcmp(isa, "scalar") == 0) {
+        return &scalarKernels;
+    }
+    return NULL;
+}
+
+void AdaptiveThreshold::apply(const cv::Mat& image, cv::Mat& grey, cv::Mat& binary, int windowSize, int C) {
+    CV_Assert((image.type() == CV_8UC3 || image.type() == CV_8UC2 || image.type() == CV_8UC1)
+              && windowSize >= 3 && (windowSize % 2) == 1);
+    const int rows = image.rows;
+    const int cols = image.cols;
+    const int radius = windowSize / 2;
+    const int channels = image.channels();
+    const bool convert = channels != 1;
+
+    if (convert) {
+        // create() keeps a buffer of the right size even when it is the one of a grey image
+        // shared on a previous call: the conversion would then write to the caller's pixels.
+        if (borrowed != NULL && grey.data == borrowed) {
+            grey.release();
+        }
+        borrowed = NULL;
+        grey.create(rows, cols, CV_8UC1);
+    } else {
+        // Unless the caller shared the pixels itself, remember that grey now points to them.
+        if (grey.data != image.data) {
+            borrowed = image.data;
+        }
+        grey = image;
+    }
+    binary.create(rows, cols, CV_8UC1);
+    if (rows == 0 || cols == 0) {
+        return;
+    }
+    // Past 256 the constant no longer changes the result, and the 16 bits arithmetic holds.
+    int delta = C < -256 ? -256 : (C > 256 ? 256 : C);
+
+    columnSums.assign(cols + 2 * radius, 0);
+    prefix.resize(cols + 2 * radius + 1);
+    int* sums = &columnSums[radius];
+    int converted = convert ? -1 : rows - 1;
+
+    // The window of the first row, with the first image row replicated above it.
+    for (int dy = -radius; dy <= radius; dy++) {
+        int y = clampRow(dy, rows);
+        if (y > converted) {
+            convertRow(image.ptr<uchar>(y), grey.ptr<uchar>(y), cols, channels);
+            converted = y;
+        }
+        const uchar* row = grey.ptr<uchar>(y);
+        for (int x = 0; x < cols; x++) {
+            sums[x] += row[x];
+        }
+    }
+
+    for (int y = 0; y < rows; y++) {
+        if (y > 0) {
+            int entering = clampRow(y + radius, rows);
+            int leaving = clampRow(y - radius - 1, rows);
+            if (entering > converted) {
+                convertRow(image.ptr<uchar>(entering), grey.ptr<uchar>(entering), cols, channels);
+                converted = entering;
+            }
+            if (entering != leaving) {
+                kernels->updateColumns(sums, grey.ptr<uchar>(entering), grey.ptr<uchar>(leaving), cols);
+            }
+        }
+        // Replicate the first and last columns on the sides.
+        for (int i = 1; i <= radius; i++) {
+            sums[-i] = sums[0];
+            sums[cols - 1 + i] = sums[cols - 1];
+        }
+        prefixSums(&columnSums[0], &prefix[0], cols + 2 * radius);
+        kernels->thresholdRow(&prefix[0], grey.ptr<uchar>(y), binary.ptr<uchar>(y), cols, windowSize, delta);
+    }
+}
+
+} /* End of namespace marker */
@@ -0,0 +1,73 @@
+/*
+ * Grey scale conversion and adaptive mean threshold fused in a single pass.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_THRESHOLD_H_
+#define SRC_THRESHOLD_H_
+
+#include <opencv2/core.hpp>
+#include <vector>
+
+namespace marker {
+
+/* The vectorized parts of the threshold, one set per instruction set. */
+struct ThresholdKernels {
+	const char* name;
+	/* sums[x] += add[x] - sub[x] */
+	void (*updateColumns)(int* sums, const uchar* add, const uchar* sub, int width);
+	/* Binary row of src from the prefix sums of the column sums of the window. */
+	void (*thresholdRow)(const int* prefix, const uchar* src, uchar* dst, int width, int windowSize, int delta);
+};
+
+/* The kernels for "scalar", "sse2" or "avx2", NULL when the CPU (or the compiler) does
+ * not support that instruction set. "avx512" gives the AVX2 kernels. NULL or "auto"
+ * select the best kernels for the CPU running the program. */
+const ThresholdKernels* thresholdKernels(const char* isa);
+
+/* Computes the same images as cv::cvtColor(CV_BGR2GRAY) followed by
+ * cv::adaptiveThreshold(ADAPTIVE_THRESH_MEAN_C, THRESH_BINARY) with a maximum value of 1,
+ * bit for bit, without the intermediate full frame buffers.
+ *
+ * The rows are streamed from top to bottom: each grey row is converted once, just before
+ * it enters the window, the column sums of the window are updated with the row entering
+ * and the row leaving it, and the binary row is produced from a prefix sum of the column
+ * sums. The working set is a few rows, it stays in the cache even for 4K frames.
+ */
+class AdaptiveThreshold {
+public:
+	AdaptiveThreshold() : kernels(thresholdKernels(NULL)), borrowed(NULL) {}
+
+	void setKernels(const ThresholdKernels* kernels) { this->kernels = kernels; }
+	const ThresholdKernels* getKernels() const { return kernels; }
+
+	/* The image is BGR (CV_8UC3), YUYV (CV_8UC2, the grey image is its luma, as
+	 * cv::cvtColor(CV_YUV2GRAY_YUYV) would give) or already grey (CV_8UC1, shared with
+	 * grey, not copied). The outputs are only re-allocated when the size of the frames
+	 * changes, or when grey still shares the pixels of a grey image and a colour one
+	 * comes: the image is never written to. */
+	void apply(const cv::Mat& image, cv::Mat& grey, cv::Mat& binary, int windowSize, int C);
+
+private:
+	const ThresholdKernels* kernels;
+	const uchar* borrowed;       // The pixels of the grey image last shared with grey
+	std::vector<int> columnSums; // Padded by windowSize/2 on each side, replicated border
+	std::vector<int> prefix;     // Prefix sums of columnSums
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_THRESHOLD_H_ */
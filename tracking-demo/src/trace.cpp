@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "trace.h"
+#include <atomic>
+
+namespace marker {
+
+namespace {
+
+const char* stageNames[STAGE_COUNT] = {
+	"findMarkers",
+	"pyramid",
+	"threshold",
+	"opening",
+	"label",
+	"filter",
+	"topology",
+	"readCode",
+	"decode",
+	"bands",
+};
+
+const char* counterNames[COUNTER_COUNT] = {
+	"components",
+	"candidates",
+	"decodeSuccess",
+	"decodeFailure",
+	"decodeCorrected",
+	"decodeErasures",
+	"fullScans",
+	"regions",
+	"coarseCandidates",
+};
+
+/* Small and stable thread identifiers for the trace viewer. */
+std::atomic<int> threadCount(0);
+thread_local int threadId = ++threadCount;
+
+} /* End of anonymous namespace */
+
+const char* stageName(int stage) {
+	return stageNames[stage];
+}
+
+const char* counterName(int counter) {
+	return counterNames[counter];
+}
+
+TraceWriter::TraceWriter() : file(NULL), first(true), origin(std::chrono::steady_clock::now()) {
+}
+
+TraceWriter::~TraceWriter() {
+	close();
+}
+
+bool TraceWriter::open(const std::string& path) {
+	close();
+	std::lock_guard<std::mutex> guard(lock);
+	file = fopen(path.c_str(), "w");
+	if (file == NULL) {
+		return false;
+	}
+	first = true;
+	fprintf(file, "{\"traceEvents\": [\n");
+	return true;
+}
+
+void TraceWriter::close() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (file != NULL) {
+		fprintf(file, "\n]}\n");
+		fclose(file);
+		file = NULL;
+	}
+}
+
+bool TraceWriter::isOpened() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return file != NULL;
+}
+
+int64_t TraceWriter::now() const {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void TraceWriter::separator() {
+	if (!first) {
+		fprintf(file, ",\n");
+	}
+	first = false;
+}
+
+void TraceWriter::complete(const char* name, int64_t start, int64_t duration) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (file != NULL) {
+		separator();
+		fprintf(file, "{\"name\": \"%s\", \"cat\": \"scanner\", \"ph\": \"X\", \"ts\": %lld, \"dur\": %lld, \"pid\": 1, \"tid\": %d}",
+		        name, (long long)start, (long long)duration, threadId);
+	}
+}
+
+void TraceWriter::counter(const char* name, int64_t timestamp, long value) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (file != NULL) {
+		separator();
+		fprintf(file, "{\"name\": \"%s\", \"cat\": \"scanner\", \"ph\": \"C\", \"ts\": %lld, \"pid\": 1, \"tid\": %d, \"args\": {\"value\": %ld}}",
+		        name, (long long)timestamp, threadId, value);
+	}
+}
+
+void ScannerStats::reset() {
+	frames = 0;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		lastUs[i] = 0;
+		totalUs[i] = 0;
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		last[i] = 0;
+		total[i] = 0;
+	}
+}
+
+void ScannerStats::beginFrame() {
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		lastUs[i] = 0;
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		last[i] = 0;
+	}
+}
+
+void ScannerStats::endFrame() {
+	frames++;
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		totalUs[i] += lastUs[i];
+	}
+	for (int i = 0; i < COUNTER_COUNT; i++) {
+		total[i] += last[i];
+	}
+#ifndef DISABLE_TRACING
+	if (trace != NULL) {
+		int64_t timestamp = trace->now();
+		for (int i = 0; i < COUNTER_COUNT; i++) {
+			trace->counter(counterNames[i], timestamp, last[i]);
+		}
+	}
+#endif
+}
+
+} /* End of namespace marker */
@@ -0,0 +1,163 @@
+/*
+ * Lightweight instrumentation of the scanner hot path: scoped timers and
+ * counters accumulated in a per-Scanner stats structure, with an optional dump
+ * in the Chrome trace event format (chrome://tracing, Perfetto).
+ *
+ * Building with DISABLE_TRACING defined removes all the timers and counters, and the
+ * per-frame bookkeeping of the stats.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+
+namespace marker {
+
+/* Stages of Scanner::findMarkers. The topology walk includes the sampling of the codes,
+ * which are decoded together once all the markers of the frame are found. */
+enum Stage {
+	STAGE_FRAME = 0,      // The whole findMarkers call
+	STAGE_PYRAMID,        // Downsampling of the frame in pyramid mode
+	STAGE_THRESHOLD,      // Grey conversion and adaptive threshold
+	STAGE_OPENING,
+	STAGE_LABEL,          // In tiled mode, the join of the bands only
+	STAGE_FILTER,
+	STAGE_TOPOLOGY,
+	STAGE_READ_CODE,
+	STAGE_DECODE,
+	STAGE_BANDS,          // Tiled mode: threshold, opening and labeling of the bands
+	STAGE_COUNT
+};
+
+enum Counter {
+	COUNTER_COMPONENTS = 0, // Connected components found in the frame
+	COUNTER_CANDIDATES,     // Components passing the children histogram test
+	COUNTER_DECODE_SUCCESS,
+	COUNTER_DECODE_FAILURE,
+	COUNTER_DECODE_CORRECTED, // Decoded after correcting errors
+	COUNTER_DECODE_ERASURES, // Only decoded with the weakest bytes erased
+	COUNTER_FULL_SCANS,     // Frames scanned entirely
+	COUNTER_REGIONS,        // Regions scanned in tracking or pyramid mode
+	COUNTER_COARSE_CANDIDATES, // Candidates found on the downsampled frame
+	COUNTER_COUNT
+};
+
+const char* stageName(int stage);
+const char* counterName(int counter);
+
+/* Writes trace events to a JSON file that can be loaded in chrome://tracing.
+ * A single writer can be shared by several scanners running in different threads. */
+class TraceWriter {
+public:
+	TraceWriter();
+	~TraceWriter();
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpened() const;
+
+	/* Timestamps are microseconds since the writer was created. */
+	int64_t now() const;
+	void complete(const char* name, int64_t start, int64_t duration);
+	void counter(const char* name, int64_t timestamp, long value);
+
+private:
+	void separator();
+
+	FILE*      file;
+	bool       first;
+	mutable std::mutex lock;
+	std::chrono::steady_clock::time_point origin;
+};
+
+/* Timings in microseconds and counters, for the last frame and since the last reset. */
+struct ScannerStats {
+	uint64_t     frames;
+	double       lastUs[STAGE_COUNT];
+	double       totalUs[STAGE_COUNT];
+	long         last[COUNTER_COUNT];
+	long         total[COUNTER_COUNT];
+	TraceWriter* trace; // Optional, not owned
+
+	ScannerStats() : trace(NULL) {
+		reset();
+	}
+
+	void reset();
+	void beginFrame();
+	void endFrame();
+
+	void add(int stage, double us) {
+		lastUs[stage] += us;
+	}
+
+	void count(int counter, long n) {
+		last[counter] += n;
+	}
+};
+
+/* Accumulates the time spent in a scope into one stage of the stats. */
+class ScopedTimer {
+public:
+	ScopedTimer(ScannerStats& stats, int stage)
+		: stats(stats), stage(stage), traceStart(0), start(std::chrono::steady_clock::now()) {
+		if (stats.trace) {
+			traceStart = stats.trace->now();
+		}
+	}
+
+	~ScopedTimer() {
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		double us = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0;
+		stats.add(stage, us);
+		if (stats.trace) {
+			stats.trace->complete(stageName(stage), traceStart, (int64_t)(us + 0.5));
+		}
+	}
+
+private:
+	ScannerStats& stats;
+	int           stage;
+	int64_t       traceStart;
+	std::chrono::steady_clock::time_point start;
+};
+
+} /* End of namespace marker */
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+/* TRACE_BEGIN_FRAME and TRACE_END_FRAME bracket the processing of a frame: the last
+ * frame values are cleared, then added to the totals and written to the trace. */
+#ifndef DISABLE_TRACING
+#define TRACE_SCOPE(stats, stage) marker::ScopedTimer TRACE_CONCAT(traceTimer, __LINE__)(stats, stage)
+#define TRACE_COUNT(stats, counter, n) (stats).count(counter, n)
+#define TRACE_BEGIN_FRAME(stats) (stats).beginFrame()
+#define TRACE_END_FRAME(stats) (stats).endFrame()
+#else
+#define TRACE_SCOPE(stats, stage) do {} while (0)
+#define TRACE_COUNT(stats, counter, n) do {} while (0)
+#define TRACE_BEGIN_FRAME(stats) do {} while (0)
+#define TRACE_END_FRAME(stats) do {} while (0)
+#endif
+
+#endif /* SRC_TRACE_H_ */
@@ -26,6 +26,8 @@
 #include <chrono>
 #include <thread>
 #include "marker.h"
+#include "framestore.h"
+#include "v4l2.h"
 
 using namespace std;
 using namespace cv;
@@ -35,53 +37,85 @@ using namespace marker;
 int main(int argc, char* argv[]) {
     std::string      windowName = "Camera";
     cv::Mat          frame;
+    cv::Mat          display;
     cv::Mat          binary;
     cv::Mat          label_image;
-    cv::VideoCapture capture(0);
+    cv::VideoCapture capture;
+    // tracking-demo DEVICE FORMAT captures GREY or YUYV frames without any conversion.
+    marker::V4l2Capture device;
+    // tracking-demo FILE replays a frame store, e.g. recorded by marker-bench --record.
+    marker::FrameStoreReader store;
 #ifndef DISABLE_GUI
     bool             showBinary = false;
 #else
     bool             showBinary = true;
 #endif
     bool             showThresholding = false;
-    std::vector<marker::Marker *> markers;
     marker::Scanner  scanner;
     int              windowSize = 25, C = 10;
 
-    if (!capture.isOpened()) {
-        cout << "ERROR INITIALIZING VIDEO CAPTURE" << endl;
-        return -1;
+    if (argc > 2) {
+        marker::V4l2Capture::Format format;
+        if (!marker::V4l2Capture::parseFormat(argv[2], format) || !device.open(argv[1], 1920, 1080, format)) {
+            cout << "ERROR INITIALIZING V4L2 CAPTURE " << device.error() << endl;
+            return -1;
+        }
+        cout << "Frame Width:  " << device.width() << endl;
+        cout << "Frame Height: " << device.height() << endl;
+    } else if (argc == 2) {
+        if (!store.open(argv[1])) {
+            cout << "ERROR OPENING FRAME STORE " << store.error() << endl;
+            return -1;
+        }
+        cout << "Frames:       " << store.count() << endl;
+        cout << "Frame Width:  " << store.size().width << endl;
+        cout << "Frame Height: " << store.size().height << endl;
+    } else {
+        capture.open(0);
+        if (!capture.isOpened()) {
+            cout << "ERROR INITIALIZING VIDEO CAPTURE" << endl;
+            return -1;
+        }
+        capture.set(cv::CAP_PROP_FRAME_HEIGHT, 1080);
+        capture.set(cv::CAP_PROP_FRAME_WIDTH, 1920);
+        //capture.set(cv::CAP_PROP_FRAME_HEIGHT, 768);
+        //capture.set(cv::CAP_PROP_FRAME_WIDTH, 1024);
+        //capture.set(cv::CAP_PROP_FRAME_HEIGHT, 768);
+        //capture.set(cv::CAP_PROP_FRAME_WIDTH, 1280);
+        //capture.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
+        //capture.set(cv::CAP_PROP_FRAME_WIDTH, 640);
+        //capture.set(cv::CAP_PROP_FPS, 30);
+        cout << "Camera FPS:   " << capture.get(cv::CAP_PROP_FPS) << endl;
+        cout << "Frame Width:  " << capture.get(cv::CAP_PROP_FRAME_WIDTH) << endl;
+        cout << "Frame Height: " << capture.get(cv::CAP_PROP_FRAME_HEIGHT) << endl;
+        //cout << "Exposure:     " << capture.get(cv::CAP_PROP_EXPOSURE) << endl;
+        cout << "Contrast:     " << capture.get(cv::CAP_PROP_CONTRAST) << endl;
+        cout << "Brightness:   " << capture.get(cv::CAP_PROP_BRIGHTNESS) << endl;
+        //cout << "Hue:          " << capture.get(cv::CAP_PROP_HUE) << endl;
+        cout << "Gain:         " << capture.get(cv::CAP_PROP_GAIN) << endl;
+        cout << "Focus:        " << capture.get(cv::CAP_PROP_FOCUS) << endl;
     }
-    capture.set(cv::CAP_PROP_FRAME_HEIGHT, 1080);
-    capture.set(cv::CAP_PROP_FRAME_WIDTH, 1920);
-    //capture.set(cv::CAP_PROP_FRAME_HEIGHT, 768);
-    //capture.set(cv::CAP_PROP_FRAME_WIDTH, 1024);
-    //capture.set(cv::CAP_PROP_FRAME_HEIGHT, 768);
-    //capture.set(cv::CAP_PROP_FRAME_WIDTH, 1280);
-    //capture.set(cv::CAP_PROP_FRAME_HEIGHT, 480);
-    //capture.set(cv::CAP_PROP_FRAME_WIDTH, 640);
-    //capture.set(cv::CAP_PROP_FPS, 30);
-    cout << "Camera FPS:   " << capture.get(cv::CAP_PROP_FPS) << endl;
-    cout << "Frame Width:  " << capture.get(cv::CAP_PROP_FRAME_WIDTH) << endl;
-    cout << "Frame Height: " << capture.get(cv::CAP_PROP_FRAME_HEIGHT) << endl;
-    //cout << "Exposure:     " << capture.get(cv::CAP_PROP_EXPOSURE) << endl;
-    cout << "Contrast:     " << capture.get(cv::CAP_PROP_CONTRAST) << endl;
-    cout << "Brightness:   " << capture.get(cv::CAP_PROP_BRIGHTNESS) << endl;
-    //cout << "Hue:          " << capture.get(cv::CAP_PROP_HUE) << endl;
-    cout << "Gain:         " << capture.get(cv::CAP_PROP_GAIN) << endl;
-    cout << "Focus:        " << capture.get(cv::CAP_PROP_FOCUS) << endl;
 #ifndef DISABLE_GUI
     // Create a named window
     cv::namedWindow(windowName, CV_WINDOW_AUTOSIZE); //create a window to display our webcam feed
 #endif
     while (1) {
     	auto t0 = std::chrono::high_resolution_clock::now();
-        bool bSuccess = capture.read(frame); // read a new frame from camera feed
+        bool bSuccess = device.isOpened() ? device.read(frame)
+                      : store.isOpened() ? store.read(frame) : capture.read(frame); // read a new frame from camera feed
         if (!bSuccess) {
             // Test if the frame has been succesfully read
             cout << "ERROR READING FRAME FROM CAMERA FEED" << endl;
             break;
         }
+#ifndef DISABLE_GUI
+        // Nothing is drawn on a captured buffer, only on a BGR copy kept from frame to frame.
+        if (frame.channels() == 3) {
+            frame.copyTo(display);
+        } else {
+            cv::cvtColor(frame, display, frame.channels() == 2 ? cv::COLOR_YUV2BGR_YUYV : cv::COLOR_GRAY2BGR);
+        }
+#endif
 
         if (!showBinary) {
         	char message[256];
@@ -89,8 +123,8 @@ int main(int argc, char* argv[]) {
         	auto t2 = std::chrono::high_resolution_clock::now();
         	sprintf(message, "%d ms", std::chrono::duration_cast<std::chrono::milliseconds>(t2-t0));
 #ifndef DISABLE_GUI
-            cv::putText(frame, message,Point(0,60),2,2,Scalar(0,0,255),2);
-            cv::imshow(windowName, frame); //show the frame in "MyVideo" window
+            cv::putText(display, message,Point(0,60),2,2,Scalar(0,0,255),2);
+            cv::imshow(windowName, display); //show the frame in "MyVideo" window
 #else
             cout << message << endl;
 #endif
@@ -109,16 +143,16 @@ int main(int argc, char* argv[]) {
                 cout << message << endl;
 #endif
         	} else {
-        		scanner.findMarkers(frame, windowSize, C, markers);
+        		const std::vector<marker::Marker>& markers = scanner.findMarkers(frame, windowSize, C);
             	auto t2 = std::chrono::high_resolution_clock::now();
             	sprintf(message, "%d us", std::chrono::duration_cast<std::chrono::microseconds>(t2-t1));
 #ifndef DISABLE_GUI
-                cv::putText(frame, message,Point(0,60),2,2,Scalar(128,128,128),2);
+                cv::putText(display, message,Point(0,60),2,2,Scalar(128,128,128),2);
                 // Draw the marker locations on the picture.
                 for (int i = 0; i < markers.size(); i++) {
-                	markers[i]->drawColor(frame);
+                	markers[i].drawColor(display);
                 }
-            	cv::imshow(windowName, frame);
+            	cv::imshow(windowName, display);
 #else
                 cout << message << endl;
 #endif
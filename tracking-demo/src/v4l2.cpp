@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "v4l2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/videodev2.h>
+#endif
+
+namespace marker {
+
+namespace {
+
+#ifdef __linux__
+/* ioctl() restarted when interrupted by a signal. */
+int xioctl(int fd, unsigned long request, void* argument) {
+    int result;
+    do {
+        result = ioctl(fd, request, argument);
+    } while (result == -1 && errno == EINTR);
+    return result;
+}
+#endif
+
+int bytesPerPixel(V4l2Capture::Format format) {
+    return format == V4l2Capture::FORMAT_YUYV ? 2 : 1;
+}
+
+} /* End of anonymous namespace */
+
+V4l2Capture::V4l2Capture()
+    : fd(-1), device(false), pixelFormat(FORMAT_GREY), frameWidth(0), frameHeight(0), bytesPerLine(0),
+      current(-1), next(0) {
+    mapping.start = NULL;
+    mapping.length = 0;
+}
+
+V4l2Capture::~V4l2Capture() {
+    close();
+}
+
+const char* V4l2Capture::formatName(Format format) {
+    return format == FORMAT_YUYV ? "YUYV" : "GREY";
+}
+
+bool V4l2Capture::parseFormat(const std::string& name, Format& format) {
+    if (name == "GREY") {
+        format = FORMAT_GREY;
+    } else if (name == "YUYV") {
+        format = FORMAT_YUYV;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool V4l2Capture::fail(const std::string& message) {
+    lastError = message + (errno != 0 ? std::string(": ") + strerror(errno) : std::string());
+    close();
+    return false;
+}
+
+bool V4l2Capture::open(const std::string& path, int width, int height, Format format, int bufferCount) {
+    close();
+    lastError.clear();
+    pixelFormat = format;
+    frameWidth = width;
+    frameHeight = height;
+    errno = 0;
+    fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0 && errno == EACCES) {
+        // A file read only is enough.
+        fd = ::open(path.c_str(), O_RDONLY);
+    }
+    if (fd < 0) {
+        return fail("Cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return fail("Cannot stat " + path);
+    }
+    device = S_ISCHR(st.st_mode);
+    return device ? openDevice(bufferCount) : openFile();
+}
+
+bool V4l2Capture::openFile() {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || frameWidth <= 0 || frameHeight <= 0) {
+        return fail("Invalid file or frame size");
+    }
+    bytesPerLine = (size_t)frameWidth * bytesPerPixel(pixelFormat);
+    mapping.length = (size_t)st.st_size;
+    if (mapping.length < bytesPerLine * frameHeight) {
+        errno = 0;
+        return fail("The file does not hold a single frame");
+    }
+    // Private and writable: a frame written to by mistake is copied, not the file.
+    void* start = mmap(NULL, mapping.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (start == MAP_FAILED) {
+        return fail("Cannot map the file");
+    }
+    mapping.start = start;
+    madvise(mapping.start, mapping.length, MADV_SEQUENTIAL);
+    next = 0;
+    return true;
+}
+
+#ifdef __linux__
+
+bool V4l2Capture::openDevice(int bufferCount) {
+    struct v4l2_capability capability;
+    memset(&capability, 0, sizeof(capability));
+    if (xioctl(fd, VIDIOC_QUERYCAP, &capability) != 0) {
+        return fail("Not a V4L2 device");
+    }
+    uint32_t caps = (capability.capabilities & V4L2_CAP_DEVICE_CAPS) ? capability.device_caps : capability.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+        errno = 0;
+        return fail("The device cannot stream captured frames");
+    }
+
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = frameWidth;
+    fmt.fmt.pix.height = frameHeight;
+    fmt.fmt.pix.pixelformat = pixelFormat == FORMAT_YUYV ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_GREY;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(fd, VIDIOC_S_FMT, &fmt) != 0) {
+        return fail("Cannot set the format");
+    }
+    if (fmt.fmt.pix.pixelformat != (pixelFormat == FORMAT_YUYV ? V4L2_PIX_FMT_YUYV : V4L2_PIX_FMT_GREY)) {
+        errno = 0;
+        return fail(std::string("The device does not capture ") + formatName(pixelFormat));
+    }
+    frameWidth = fmt.fmt.pix.width;
+    frameHeight = fmt.fmt.pix.height;
+    bytesPerLine = fmt.fmt.pix.bytesperline;
+    if (bytesPerLine < (size_t)frameWidth * bytesPerPixel(pixelFormat)) {
+        bytesPerLine = (size_t)frameWidth * bytesPerPixel(pixelFormat);
+    }
+
+    struct v4l2_requestbuffers request;
+    memset(&request, 0, sizeof(request));
+    request.count = bufferCount;
+    request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    request.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd, VIDIOC_REQBUFS, &request) != 0 || request.count < 2) {
+        return fail("Cannot get the capture buffers");
+    }
+    for (unsigned i = 0; i < request.count; i++) {
+        struct v4l2_buffer buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = i;
+        if (xioctl(fd, VIDIOC_QUERYBUF, &buffer) != 0) {
+            return fail("Cannot query a capture buffer");
+        }
+        void* start = mmap(NULL, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer.m.offset);
+        if (start == MAP_FAILED) {
+            return fail("Cannot map a capture buffer");
+        }
+        Buffer mapped = { start, buffer.length };
+        buffers.push_back(mapped);
+        if (xioctl(fd, VIDIOC_QBUF, &buffer) != 0) {
+            return fail("Cannot queue a capture buffer");
+        }
+    }
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd, VIDIOC_STREAMON, &type) != 0) {
+        return fail("Cannot start streaming");
+    }
+    current = -1;
+    return true;
+}
+
+#else
+
+bool V4l2Capture::openDevice(int) {
+    errno = 0;
+    return fail("V4L2 devices are only supported on Linux");
+}
+
+#endif /* __linux__ */
+
+bool V4l2Capture::read(cv::Mat& frame) {
+    if (fd < 0) {
+        return false;
+    }
+    const int type = pixelFormat == FORMAT_YUYV ? CV_8UC2 : CV_8UC1;
+    const size_t frameBytes = bytesPerLine * frameHeight;
+    if (!device) {
+        if (next + frameBytes > mapping.length) {
+            return false;
+        }
+        frame = cv::Mat(frameHeight, frameWidth, type, (uchar*)mapping.start + next, bytesPerLine);
+        next += frameBytes;
+        return true;
+    }
+#ifdef __linux__
+    struct v4l2_buffer buffer;
+    if (current >= 0) {
+        // The previous frame is done with, its buffer can be filled again.
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = current;
+        current = -1;
+        if (xioctl(fd, VIDIOC_QBUF, &buffer) != 0) {
+            lastError = std::string("Cannot queue a capture buffer: ") + strerror(errno);
+            return false;
+        }
+    }
+    for (;;) {
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(fd, VIDIOC_DQBUF, &buffer) != 0) {
+            lastError = std::string("Cannot dequeue a frame: ") + strerror(errno);
+            return false;
+        }
+        if (!(buffer.flags & V4L2_BUF_FLAG_ERROR) && buffer.bytesused >= frameBytes) {
+            break;
+        }
+        // A corrupted or short frame, give the buffer back and wait for the next one.
+        if (xioctl(fd, VIDIOC_QBUF, &buffer) != 0) {
+            lastError = std::string("Cannot queue a capture buffer: ") + strerror(errno);
+            return false;
+        }
+    }
+    current = buffer.index;
+    frame = cv::Mat(frameHeight, frameWidth, type, buffers[current].start, bytesPerLine);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void V4l2Capture::close() {
+#ifdef __linux__
+    if (device && fd >= 0 && !buffers.empty()) {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        xioctl(fd, VIDIOC_STREAMOFF, &type);
+    }
+#endif
+    for (size_t i = 0; i < buffers.size(); i++) {
+        munmap(buffers[i].start, buffers[i].length);
+    }
+    buffers.clear();
+    current = -1;
+    if (mapping.start != NULL) {
+        munmap(mapping.start, mapping.length);
+        mapping.start = NULL;
+        mapping.length = 0;
+    }
+    next = 0;
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+} /* End of namespace marker */
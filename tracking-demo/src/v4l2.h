@@ -0,0 +1,106 @@
+/*
+ * Zero-copy capture of grey or YUYV frames from V4L2 devices.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_V4L2_H_
+#define SRC_V4L2_H_
+
+#include <opencv2/core.hpp>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace marker {
+
+/* Captures frames from a V4L2 device in its own pixel format, without conversion.
+ *
+ * cv::VideoCapture converts every frame to BGR, and the scanner then computes the grey
+ * image back from it. Here the driver fills buffers mapped in memory and read() returns
+ * a cv::Mat header over the dequeued buffer: CV_8UC1 for GREY, handed to the Scanner as
+ * its grey image, or CV_8UC2 for YUYV, from which the threshold picks the luma bytes in
+ * the same pass (see AdaptiveThreshold). No pixel is copied nor converted on the way.
+ *
+ * A regular file is opened as a fake device: raw frames of the given size and format
+ * back to back, e.g. recorded by v4l2-ctl --stream-mmap --stream-to=FILE. The file is
+ * mapped in memory and the frames are views of the mapping in the same way, so that the
+ * path can be tested and measured without a camera (a v4l2loopback device works too).
+ */
+class V4l2Capture {
+public:
+	enum Format {
+		FORMAT_GREY = 0, // 8 bits luma, V4L2_PIX_FMT_GREY
+		FORMAT_YUYV      // 4:2:2 packed Y0 U Y1 V, V4L2_PIX_FMT_YUYV
+	};
+
+	V4l2Capture();
+	~V4l2Capture();
+
+	/* Starts streaming width x height frames through bufferCount buffers. The driver may
+	 * pick another size, see width() and height(), but not another format. Returns false
+	 * on failure, the reason is in error(). */
+	bool open(const std::string& path, int width, int height, Format format, int bufferCount = 4);
+	void close();
+	bool isOpened() const { return fd >= 0; }
+
+	/* The next frame, as a view of the buffer holding it: it is only valid until the next
+	 * call to read() or close(), when the buffer goes back to the driver. Blocks until a
+	 * frame is available. Returns false at the end of a file or on failure. */
+	bool read(cv::Mat& frame);
+
+	int width() const { return frameWidth; }
+	int height() const { return frameHeight; }
+	Format format() const { return pixelFormat; }
+	/* Was a V4L2 device opened, rather than a file? */
+	bool isDevice() const { return device; }
+	const std::string& error() const { return lastError; }
+
+	/* "GREY" or "YUYV". */
+	static const char* formatName(Format format);
+	static bool parseFormat(const std::string& name, Format& format);
+
+private:
+	V4l2Capture(const V4l2Capture&);
+	V4l2Capture& operator=(const V4l2Capture&);
+
+	bool openDevice(int bufferCount);
+	bool openFile();
+	bool fail(const std::string& message);
+
+	struct Buffer {
+		void*  start;
+		size_t length;
+	};
+
+	int         fd;
+	bool        device;
+	Format      pixelFormat;
+	int         frameWidth;
+	int         frameHeight;
+	size_t      bytesPerLine;
+	std::string lastError;
+
+	/* Device: the buffers mapped, and the one held by the last frame, -1 if none. */
+	std::vector<Buffer> buffers;
+	int current;
+	/* File: the whole file mapped, and the offset of the next frame. */
+	Buffer mapping;
+	size_t next;
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_V4L2_H_ */
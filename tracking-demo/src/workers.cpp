@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#include "workers.h"
+
+namespace marker {
+
+namespace {
+
+inline uint64_t packRange(uint32_t begin, uint32_t end) {
+    return (uint64_t)begin << 32 | end;
+}
+
+inline uint32_t rangeBegin(uint64_t range) {
+    return (uint32_t)(range >> 32);
+}
+
+inline uint32_t rangeEnd(uint64_t range) {
+    return (uint32_t)range;
+}
+
+} /* End of anonymous namespace */
+
+WorkerPool::WorkerPool(int threads)
+    : threads(threads < 1 ? 1 : threads), slots(new Slot[threads < 1 ? 1 : threads]), remaining(0),
+      body(NULL), generation(0), active(0), stopping(false) {
+    for (int i = 0; i < this->threads; i++) {
+        slots[i].range.store(0);
+    }
+    // Thread 0 is the caller of parallelFor().
+    for (int i = 1; i < this->threads; i++) {
+        workers.push_back(std::thread(&WorkerPool::work, this, i));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int)>& body) {
+    parallelFor(count, [&body](int i, int) { body(i); });
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int, int)>& body) {
+    if (count <= 0) {
+        return;
+    }
+    if (threads == 1 || count == 1) {
+        for (int i = 0; i < count; i++) {
+            body(i, 0);
+        }
+        return;
+    }
+    {
+        // No worker is in a loop, the ranges can be reset without any race.
+        std::lock_guard<std::mutex> guard(lock);
+        for (int t = 0; t < threads; t++) {
+            slots[t].range.store(packRange((uint32_t)((int64_t)count * t / threads),
+                                           (uint32_t)((int64_t)count * (t + 1) / threads)));
+        }
+        remaining.store(count);
+        this->body = &body;
+        generation++;
+    }
+    wake.notify_all();
+    run(0, body);
+
+    // Once the caller is out of work, the iterations left are running in the workers:
+    // wait for them. The loop is closed under the lock, a worker waking up late does not
+    // join it.
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this] { return active == 0 && remaining.load() == 0; });
+    this->body = NULL;
+}
+
+void WorkerPool::work(int self) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [this, &seen] { return stopping || generation != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+        if (body == NULL) {
+            continue;
+        }
+        const std::function<void(int, int)>* job = body;
+        active++;
+        guard.unlock();
+        run(self, *job);
+        guard.lock();
+        active--;
+        done.notify_all();
+    }
+}
+
+/* Runs iterations until there are none left to take or to steal. */
+void WorkerPool::run(int self, const std::function<void(int, int)>& body) {
+    for (;;) {
+        int i = take(self);
+        if (i < 0) {
+            i = steal(self);
+        }
+        if (i < 0) {
+            return;
+        }
+        body(i, self);
+        remaining.fetch_sub(1);
+    }
+}
+
+/* The first iteration of the own range. */
+int WorkerPool::take(int self) {
+    std::atomic<uint64_t>& range = slots[self].range;
+    uint64_t current = range.load();
+    for (;;) {
+        uint32_t begin = rangeBegin(current), end = rangeEnd(current);
+        if (begin >= end) {
+            return -1;
+        }
+        if (range.compare_exchange_weak(current, packRange(begin + 1, end))) {
+            return (int)begin;
+        }
+    }
+}
+
+/* Moves the back half of the range of another thread to the own, empty, range and
+ * returns its first iteration. The ranges only shrink during a loop and each iteration
+ * is in one range only, so a range seen earlier cannot come back (no ABA). */
+int WorkerPool::steal(int self) {
+    for (int k = 1; k < threads; k++) {
+        std::atomic<uint64_t>& victim = slots[(self + k) % threads].range;
+        uint64_t current = victim.load();
+        for (;;) {
+            uint32_t begin = rangeBegin(current), end = rangeEnd(current);
+            if (begin >= end) {
+                break;
+            }
+            uint32_t middle = begin + (end - begin) / 2;
+            if (victim.compare_exchange_weak(current, packRange(begin, middle))) {
+                slots[self].range.store(packRange(middle + 1, end));
+                return (int)middle;
+            }
+        }
+    }
+    return -1;
+}
+
+} /* End of namespace marker */
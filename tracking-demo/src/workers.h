@@ -0,0 +1,90 @@
+/*
+ * Pool of threads sharing the iterations of a loop by work stealing.
+ *
+ * Copyright (C) 2016-2017 Laurent GAUTHIER <laurent.gauthier@soccasys.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ */
+
+#ifndef SRC_WORKERS_H_
+#define SRC_WORKERS_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace marker {
+
+/* The thread calling parallelFor() and threads - 1 workers run the iterations of a loop.
+ *
+ * The iterations are split in as many contiguous ranges as there are threads, one per
+ * thread. Each thread takes the iterations of its own range from the front, and once it
+ * is empty steals the back half of the range of another thread, so that a thread that
+ * was given the slow iterations does not keep the others waiting. A range is a single
+ * 64 bits word, begin and end, updated by compare and swap: taking or stealing needs
+ * no lock. The lock is only taken to start and to finish a loop.
+ */
+class WorkerPool {
+public:
+	/* threads is the number of threads running a loop, the caller included. */
+	explicit WorkerPool(int threads);
+	~WorkerPool();
+
+	int size() const { return threads; }
+
+	/* Calls body(i) for every i in [0, count) and returns once all the calls are done.
+	 * The calls run in any order, in any of the threads: body must not throw. The pool
+	 * runs one loop at a time, parallelFor() is called by one thread only. */
+	void parallelFor(int count, const std::function<void(int)>& body);
+	/* The same with body(i, thread), thread in [0, size()) the index of the thread making
+	 * the call, e.g. to give each thread its own buffers. */
+	void parallelFor(int count, const std::function<void(int, int)>& body);
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+
+	/* The range of a thread, padded apart so that the threads do not write to the same
+	 * cache line (alignas would need the C++17 aligned new). */
+	struct Slot {
+		char padding[64];
+		std::atomic<uint64_t> range; // begin << 32 | end
+	};
+
+	void work(int self);
+	void run(int self, const std::function<void(int, int)>& body);
+	int take(int self);
+	int steal(int self);
+
+	const int threads;
+	std::vector<std::thread> workers;
+	std::unique_ptr<Slot[]> slots;
+	std::atomic<int> remaining; // Iterations of the loop not done yet
+
+	std::mutex lock;
+	std::condition_variable wake; // A loop starts, or the pool stops
+	std::condition_variable done; // A worker left the loop
+	const std::function<void(int, int)>* body; // The running loop, NULL between loops
+	uint64_t generation;          // Incremented by every loop
+	int active;                   // Workers running the loop
+	bool stopping;
+};
+
+} /* End of namespace marker */
+
+#endif /* SRC_WORKERS_H_ */